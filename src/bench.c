@@ -0,0 +1,139 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "vm.h"
+
+// Each benchmark script is interpreted in a fresh VM, first for a few warmup
+// iterations and then often enough to fill the time budget below. Scripts must
+// not print, so that stdout stays machine-readable (tab-separated, one line
+// per benchmark).
+
+#define BENCH_WARMUP_ITERATIONS 3
+#define BENCH_MIN_ITERATIONS 5
+#define BENCH_MAX_ITERATIONS 100
+#define BENCH_TARGET_NANOSECONDS (1000ull * 1000ull * 1000ull)
+
+[[nodiscard]] static char* read_file(char const* const path) {
+    auto const file = fopen(path, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return nullptr;
+    }
+    fseek(file, 0L, SEEK_END);
+    auto const file_size = (size_t)ftell(file);
+    rewind(file);
+
+    auto const buffer = (char*)malloc(file_size + 1);
+    if (buffer == nullptr) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        fclose(file);
+        return nullptr;
+    }
+    auto const bytes_read = fread(buffer, sizeof(char), file_size, file);
+    if (bytes_read < file_size) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        fclose(file);
+        return nullptr;
+    }
+    buffer[bytes_read] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+[[nodiscard]] static uint64_t monotonic_nanoseconds() {
+    struct timespec timestamp;
+    clock_gettime(CLOCK_MONOTONIC, &timestamp);
+    return (uint64_t)timestamp.tv_sec * 1000000000ull + (uint64_t)timestamp.tv_nsec;
+}
+
+// Nanoseconds spent interpreting the script once, or 0 if it did not run to
+// completion.
+[[nodiscard]] static uint64_t run_once(char const* const source) {
+    static VM vm;
+    init_vm(&vm);
+    auto const start = monotonic_nanoseconds();
+    auto const result = interpret(&vm, source);
+    auto const elapsed = monotonic_nanoseconds() - start;
+    free_vm(&vm);
+    if (result != INTERPRET_OK) {
+        return 0;
+    }
+    return elapsed > 0 ? elapsed : 1;
+}
+
+[[nodiscard]] static bool run_benchmark(char const* const path) {
+    auto const source = read_file(path);
+    if (source == nullptr) {
+        return false;
+    }
+
+    auto last_elapsed = (uint64_t)0;
+    for (auto i = 0; i < BENCH_WARMUP_ITERATIONS; ++i) {
+        last_elapsed = run_once(source);
+        if (last_elapsed == 0) {
+            fprintf(stderr, "Benchmark \"%s\" failed.\n", path);
+            free(source);
+            return false;
+        }
+    }
+
+    // Size the measured run so it takes roughly the time budget.
+    auto iterations = (int)(BENCH_TARGET_NANOSECONDS / last_elapsed);
+    if (iterations < BENCH_MIN_ITERATIONS) {
+        iterations = BENCH_MIN_ITERATIONS;
+    }
+    if (iterations > BENCH_MAX_ITERATIONS) {
+        iterations = BENCH_MAX_ITERATIONS;
+    }
+
+    auto const samples = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)iterations);
+    if (samples == nullptr) {
+        free(source);
+        return false;
+    }
+
+    auto sum = (uint64_t)0;
+    for (auto i = 0; i < iterations; ++i) {
+        samples[i] = run_once(source);
+        if (samples[i] == 0) {
+            fprintf(stderr, "Benchmark \"%s\" failed.\n", path);
+            free(samples);
+            free(source);
+            return false;
+        }
+        sum += samples[i];
+    }
+
+    auto const mean = (double)sum / (double)iterations;
+    auto squared_deviations = 0.0;
+    for (auto i = 0; i < iterations; ++i) {
+        auto const deviation = (double)samples[i] - mean;
+        squared_deviations += deviation * deviation;
+    }
+    auto const stddev = sqrt(squared_deviations / (double)iterations);
+
+    printf("%s\t%d\t%.0f\t%.0f\n", path, iterations, mean, stddev);
+    free(samples);
+    free(source);
+    return true;
+}
+
+int main(int const argc, char const* const* const argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: clox_bench <benchmark.lox>...\n");
+        return 64;
+    }
+
+    printf("benchmark\titerations\tmean_ns\tstddev_ns\n");
+    auto all_succeeded = true;
+    for (auto i = 1; i < argc; ++i) {
+        if (not run_benchmark(argv[i])) {
+            all_succeeded = false;
+        }
+    }
+    return all_succeeded ? 0 : 1;
+}
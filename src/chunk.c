@@ -1,49 +1,173 @@
 #include "chunk.h"
 #include <stdlib.h>
 #include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+[[nodiscard]] char const* opcode_name(uint8_t const opcode) {
+    // Designated initializers keep the table in sync with the OpCode enum.
+    static char const* const names[UINT8_COUNT] = {
+        [OP_CONSTANT] = "OP_CONSTANT",
+        [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+        [OP_NIL] = "OP_NIL",
+        [OP_TRUE] = "OP_TRUE",
+        [OP_FALSE] = "OP_FALSE",
+        [OP_POP] = "OP_POP",
+        [OP_GET_LOCAL] = "OP_GET_LOCAL",
+        [OP_SET_LOCAL] = "OP_SET_LOCAL",
+        [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+        [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+        [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+        [OP_EQUAL] = "OP_EQUAL",
+        [OP_GREATER] = "OP_GREATER",
+        [OP_LESS] = "OP_LESS",
+        [OP_NEGATE] = "OP_NEGATE",
+        [OP_PRINT] = "OP_PRINT",
+        [OP_JUMP] = "OP_JUMP",
+        [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+        [OP_JUMP_IF_TRUE] = "OP_JUMP_IF_TRUE",
+        [OP_LOOP] = "OP_LOOP",
+        [OP_ADD] = "OP_ADD",
+        [OP_SUBTRACT] = "OP_SUBTRACT",
+        [OP_MULTIPLY] = "OP_MULTIPLY",
+        [OP_DIVIDE] = "OP_DIVIDE",
+        [OP_NOT] = "OP_NOT",
+        [OP_CALL] = "OP_CALL",
+        [OP_TAIL_CALL] = "OP_TAIL_CALL",
+        [OP_CLOSURE] = "OP_CLOSURE",
+        [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+        [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+        [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+        [OP_RETURN] = "OP_RETURN",
+        [OP_LIST] = "OP_LIST",
+        [OP_INDEX_GET] = "OP_INDEX_GET",
+        [OP_INDEX_SET] = "OP_INDEX_SET",
+        [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+        [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+        [OP_LESS_CONSTANT] = "OP_LESS_CONSTANT",
+        [OP_LESS_JUMP_IF_FALSE] = "OP_LESS_JUMP_IF_FALSE",
+        [OP_ADD_CONSTANT] = "OP_ADD_CONSTANT",
+        [OP_INCREMENT_LOCAL] = "OP_INCREMENT_LOCAL",
+    };
+    return names[opcode] != nullptr ? names[opcode] : "OP_UNKNOWN";
+}
 
 void init_chunk(Chunk* const chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = nullptr;
-    chunk->lines = nullptr;
+    chunk->line_run_count = 0;
+    chunk->line_run_capacity = 0;
+    chunk->line_runs = nullptr;
     init_value_array(&chunk->constants);
 }
 
-void free_chunk(Chunk* const chunk) {
-    free_value_array(&chunk->constants);
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+void free_chunk(VM* const vm, Chunk* const chunk) {
+    free_value_array(vm, &chunk->constants);
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, LineRun, chunk->line_runs, chunk->line_run_capacity);
     init_chunk(chunk);
 }
 
-void write_chunk(Chunk* const chunk, uint8_t const byte, int const line) {
+void write_chunk(VM* const vm, Chunk* const chunk, uint8_t const byte, int const line) {
     if (chunk->capacity < chunk->count + 1) {
         auto const old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, old_capacity, chunk->capacity);
+    }
+
+    // Consecutive bytes on the same line extend the current run for free.
+    if (chunk->line_run_count == 0 or chunk->line_runs[chunk->line_run_count - 1].line != line) {
+        if (chunk->line_run_capacity < chunk->line_run_count + 1) {
+            auto const old_capacity = chunk->line_run_capacity;
+            chunk->line_run_capacity = GROW_CAPACITY(old_capacity);
+            chunk->line_runs = GROW_ARRAY(vm, LineRun, chunk->line_runs, old_capacity, chunk->line_run_capacity);
+        }
+        chunk->line_runs[chunk->line_run_count].start = chunk->count;
+        chunk->line_runs[chunk->line_run_count].line = line;
+        ++(chunk->line_run_count);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     ++(chunk->count);
 }
 
-[[nodiscard]] int add_constant(Chunk* const chunk, Value const value) {
-    write_value_array(&chunk->constants, value);
+void truncate_chunk(Chunk* const chunk, int const count) {
+    chunk->count = count;
+    while (chunk->line_run_count > 0 and chunk->line_runs[chunk->line_run_count - 1].start >= count) {
+        --(chunk->line_run_count);
+    }
+}
+
+[[nodiscard]] int chunk_line(Chunk const* const chunk, int const offset) {
+    // Binary search for the last run starting at or before the offset.
+    auto low = 0;
+    auto high = chunk->line_run_count - 1;
+    while (low < high) {
+        auto const mid = (low + high + 1) / 2;
+        if (chunk->line_runs[mid].start <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return chunk->line_run_count == 0 ? 0 : chunk->line_runs[low].line;
+}
+
+[[nodiscard]] int instruction_length(Chunk const* const chunk, int const offset) {
+    switch ((OpCode)chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_SET_LOCAL_POP:
+        case OP_LESS_CONSTANT:
+        case OP_ADD_CONSTANT:
+        case OP_LIST:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_ADD_LOCALS:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_INCREMENT_LOCAL:
+            return 3;
+        case OP_CONSTANT_LONG:
+            return 4;
+        case OP_CLOSURE: {
+            auto const function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalue_count * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+[[nodiscard]] int add_constant(VM* const vm, Chunk* const chunk, Value const value) {
+    // Growing the constant pool can trigger a collection before the value is
+    // stored, so it has to be reachable from the stack in the meantime.
+    push(vm, value);
+    write_value_array(vm, &chunk->constants, value);
+    (void)pop(vm);
     return chunk->constants.count - 1;
 }
 
-void write_constant(Chunk* const chunk, Value const value, int const line) {
-    auto const constant_index = add_constant(chunk, value);
+void write_constant(VM* const vm, Chunk* const chunk, Value const value, int const line) {
+    auto const constant_index = add_constant(vm, chunk, value);
     if (constant_index <= UINT8_MAX) {
-        write_chunk(chunk, OP_CONSTANT, line);
-        write_chunk(chunk, (uint8_t)constant_index, line);
+        write_chunk(vm, chunk, OP_CONSTANT, line);
+        write_chunk(vm, chunk, (uint8_t)constant_index, line);
     } else {
-        write_chunk(chunk, OP_CONSTANT_LONG, line);
-        write_chunk(chunk, (uint8_t)(constant_index >> 16), line);
-        write_chunk(chunk, (uint8_t)(constant_index >> 8), line);
-        write_chunk(chunk, (uint8_t)constant_index, line);
+        write_chunk(vm, chunk, OP_CONSTANT_LONG, line);
+        write_chunk(vm, chunk, (uint8_t)(constant_index >> 16), line);
+        write_chunk(vm, chunk, (uint8_t)(constant_index >> 8), line);
+        write_chunk(vm, chunk, (uint8_t)constant_index, line);
     }
 }
@@ -22,6 +22,7 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
     OP_LOOP,
     OP_ADD,
     OP_SUBTRACT,
@@ -29,23 +30,59 @@ typedef enum {
     OP_DIVIDE,
     OP_NOT,
     OP_CALL,
+    OP_TAIL_CALL,  // like OP_CALL, but reuses the current call frame (1 byte operand)
     OP_CLOSURE,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
+    OP_LIST,  // pop n elements into a new list (1 byte element count)
+    OP_INDEX_GET,  // push list[index]
+    OP_INDEX_SET,  // list[index] = value
+    // Fused superinstructions, produced by the compiler's peephole pass for
+    // frequent opcode pairs/triples so they execute in a single dispatch.
+    OP_ADD_LOCALS,  // push locals[a] + locals[b] (2 byte operands)
+    OP_SET_LOCAL_POP,  // locals[slot] = pop()
+    OP_LESS_CONSTANT,  // push pop() < constant (1 byte constant index)
+    OP_LESS_JUMP_IF_FALSE,  // OP_LESS followed by a conditional forward jump
+    OP_ADD_CONSTANT,  // push pop() + constant (1 byte constant index)
+    OP_INCREMENT_LOCAL,  // locals[a] = locals[a] + constant (slot and constant index operands)
 } OpCode;
 
+// Line information is run-length encoded: each run records the first bytecode
+// offset it covers, so a run ends where the next one starts (or at the end of
+// the code). Lines are only read on the error and disassembly paths, which
+// pay for a binary search instead.
+typedef struct {
+    int start;  // first bytecode offset covered by this run
+    int line;
+} LineRun;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    int line_run_count;
+    int line_run_capacity;
+    LineRun* line_runs;
     ValueArray constants;
 } Chunk;
 
+// Name of the opcode (e.g. "OP_ADD"), or "OP_UNKNOWN" for bytes that are no
+// valid opcode.
+[[nodiscard]] char const* opcode_name(uint8_t opcode);
+
 void init_chunk(Chunk* chunk);
-void free_chunk(Chunk* chunk);
-void write_chunk(Chunk* chunk, uint8_t byte, int line);
-[[nodiscard]] int add_constant(Chunk* chunk, Value value);
-void write_constant(Chunk* chunk, Value value, int line);
+void free_chunk(VM* vm, Chunk* chunk);
+void write_chunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+// Drops all code from offset `count` on, including the line runs starting
+// there. Used by the compiler to rewind instructions it folds away.
+void truncate_chunk(Chunk* chunk, int count);
+// Source line of the instruction at the given bytecode offset.
+[[nodiscard]] int chunk_line(Chunk const* chunk, int offset);
+// Length in bytes of the instruction at `offset`. OP_CLOSURE's variable
+// operand list is decoded through its function constant, like the
+// disassembler does.
+[[nodiscard]] int instruction_length(Chunk const* chunk, int offset);
+[[nodiscard]] int add_constant(VM* vm, Chunk* chunk, Value value);
+void write_constant(VM* vm, Chunk* chunk, Value value, int line);
@@ -4,7 +4,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// DEBUG_PRINT_CODE, DEBUG_TRACE_EXECUTION, and DEBUG_LOG_GC are defined via
+// the clox_debug_* CMake options (see src/CMakeLists.txt) so that benchmark
+// builds are never accidentally poisoned by tracing output.
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+
+// Everything that allocates or touches the runtime takes an explicit VM
+// context (defined in vm.h), so multiple isolated VMs can coexist in one
+// process. Forward-declared here because nearly every header needs the type.
+typedef struct VM VM;
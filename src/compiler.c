@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -44,6 +45,9 @@ typedef struct {
     Token name;
     int depth;
     bool is_captured;
+    // Index of the local this one shadows in the scope map, or -1; restored
+    // when this local goes out of scope.
+    int shadowed;
 } Local;
 
 typedef struct {
@@ -56,6 +60,24 @@ typedef enum {
     TYPE_SCRIPT,
 } FunctionType;
 
+// Slot of the compile-time map from constant value to constant-pool index,
+// used to deduplicate the pool. The map only exists while compiling; loaded
+// chunks never pay for it.
+typedef struct {
+    Value value;
+    int index;  // -1 marks an empty slot.
+} ConstantMapEntry;
+
+// Slot of the compile-time scope symbol map from identifier name to the index
+// of the innermost local with that name, making resolution O(1) instead of a
+// backwards scan over the locals array. A shadowed index is remembered on the
+// Local itself (see Local.shadowed), so popping a scope restores the previous
+// binding in O(1) as well.
+typedef struct {
+    Token name;
+    int index;  // -1 marks a slot with no live local (empty or vacated).
+} ScopeMapEntry;
+
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
@@ -65,10 +87,74 @@ typedef struct Compiler {
     int local_count;
     Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
+
+    // Peephole state: byte offsets of the last three emitted instructions, or
+    // -1 where fusing across the boundary would be unsafe (jump targets).
+    int last_instruction;
+    int previous_instruction;
+    int earlier_instruction;
+
+    // Constant-pool dedup map (open addressing, arena allocation — not part
+    // of the collected heap).
+    ConstantMapEntry* constant_map;
+    int constant_map_count;
+    int constant_map_capacity;
+
+    // Scope symbol map (open addressing, arena allocation, like the constant
+    // map above).
+    ScopeMapEntry* scope_map;
+    int scope_map_count;
+    int scope_map_capacity;
 } Compiler;
 
-Parser parser;
-Compiler* current = nullptr;
+// The compiler state is per-thread, so each worker thread can compile for its
+// own VM without locking; only one compilation per thread runs at a time.
+static thread_local Parser parser;
+static thread_local Compiler* current = nullptr;
+// VM the current compilation allocates into (functions, strings, globals).
+static thread_local VM* current_vm = nullptr;
+
+// Bump arena for compile-time tables (the constant and scope maps below).
+// Allocation is a pointer bump into the current block; nothing is freed
+// individually — a map that outgrows its slab simply abandons it — and
+// arena_release() returns everything at once when the top-level compilation
+// finishes. thread_local like the rest of the compiler state.
+#define ARENA_BLOCK_SIZE ((size_t)64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* previous;
+    size_t used;
+    size_t capacity;
+    alignas(max_align_t) char data[];
+} ArenaBlock;
+
+static thread_local ArenaBlock* arena = nullptr;
+
+[[nodiscard]] static void* arena_allocate(size_t size) {
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    if (arena == nullptr or arena->capacity - arena->used < size) {
+        auto const capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        auto const block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + capacity);
+        if (block == nullptr) {
+            exit(1);
+        }
+        block->previous = arena;
+        block->used = 0;
+        block->capacity = capacity;
+        arena = block;
+    }
+    auto const allocation = arena->data + arena->used;
+    arena->used += size;
+    return allocation;
+}
+
+static void arena_release() {
+    while (arena != nullptr) {
+        auto const previous = arena->previous;
+        free(arena);
+        arena = previous;
+    }
+}
 
 [[nodiscard]] static Chunk* current_chunk() {
     return &current->function->chunk;
@@ -136,7 +222,7 @@ static void consume(TokenType const type, char const* const message) {
 }
 
 static void emit_byte(uint8_t const byte) {
-    write_chunk(current_chunk(), byte, parser.previous.line);
+    write_chunk(current_vm, current_chunk(), byte, parser.previous.line);
 }
 
 static void emit_bytes(uint8_t const byte1, uint8_t const byte2) {
@@ -144,6 +230,29 @@ static void emit_bytes(uint8_t const byte1, uint8_t const byte2) {
     emit_byte(byte2);
 }
 
+// Remembers that an instruction is about to be emitted at the current chunk
+// offset, making it a candidate for superinstruction fusion.
+static void record_instruction() {
+    current->earlier_instruction = current->previous_instruction;
+    current->previous_instruction = current->last_instruction;
+    current->last_instruction = current_chunk()->count;
+}
+
+// Forgets the recorded instructions. Called wherever a jump target lands so
+// that fusion never straddles a label.
+static void invalidate_peephole() {
+    current->last_instruction = -1;
+    current->previous_instruction = -1;
+    current->earlier_instruction = -1;
+}
+
+// Whether the given offset holds the given opcode and the instruction (with
+// operand_size operand bytes) ends exactly at the current end of the chunk.
+[[nodiscard]] static bool instruction_at(int const offset, uint8_t const opcode, int const operand_size) {
+    auto const chunk = current_chunk();
+    return offset != -1 and offset == chunk->count - 1 - operand_size and chunk->code[offset] == opcode;
+}
+
 static void emit_loop(int const loop_start) {
     emit_byte(OP_LOOP);
 
@@ -154,12 +263,19 @@ static void emit_loop(int const loop_start) {
 
     emit_byte((uint8_t)((offset >> 8) & 0xFF));
     emit_byte((uint8_t)(offset & 0xFF));
+    invalidate_peephole();
 }
 
 static int emit_jump(uint8_t const instruction) {
-    emit_byte(instruction);
+    if (instruction == OP_JUMP_IF_FALSE and instruction_at(current->last_instruction, OP_LESS, 0)) {
+        // Fuse the comparison into the branch; the stack effect is unchanged.
+        current_chunk()->code[current->last_instruction] = OP_LESS_JUMP_IF_FALSE;
+    } else {
+        emit_byte(instruction);
+    }
     emit_byte(0xFF);
     emit_byte(0xFF);
+    invalidate_peephole();
     return current_chunk()->count - 2;
 }
 
@@ -168,14 +284,180 @@ static void emit_return() {
     emit_byte(OP_RETURN);
 }
 
+[[nodiscard]] static uint32_t hash_constant(Value const value) {
+    uint64_t bits;
+#ifdef CLOX_NAN_BOXING
+    bits = value;
+#else
+    if (IS_NUMBER(value)) {
+        auto const number = AS_NUMBER(value);
+        memcpy(&bits, &number, sizeof(number));
+    } else if (IS_OBJ(value)) {
+        bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+    } else {
+        bits = ((uint64_t)value.type << 1) | (uint64_t)(IS_BOOL(value) and AS_BOOL(value));
+    }
+#endif
+    // Fibonacci hashing to mix the 64 bits down to 32.
+    return (uint32_t)((bits * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// Bitwise equality, agreeing with hash_constant() where values_equal() would
+// not: 0.0 and -0.0 stay distinct pool entries (folded negation must not turn
+// `print -0;` into `print 0;`), and a NaN constant dedups onto itself instead
+// of appending a fresh slot per occurrence.
+[[nodiscard]] static bool constants_equal(Value const a, Value const b) {
+#ifdef CLOX_NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type) {
+        return false;
+    }
+    if (IS_NUMBER(a)) {
+        auto const a_number = AS_NUMBER(a);
+        auto const b_number = AS_NUMBER(b);
+        return memcmp(&a_number, &b_number, sizeof(a_number)) == 0;
+    }
+    if (IS_OBJ(a)) {
+        // Strings are interned, so identity is equality.
+        return AS_OBJ(a) == AS_OBJ(b);
+    }
+    return not IS_BOOL(a) or AS_BOOL(a) == AS_BOOL(b);
+#endif
+}
+
+// Index of the pool entry already holding this constant, or -1.
+[[nodiscard]] static int constant_map_find(Compiler const* const compiler, Value const value) {
+    if (compiler->constant_map_capacity == 0) {
+        return -1;
+    }
+    auto slot = hash_constant(value) & (uint32_t)(compiler->constant_map_capacity - 1);
+    for (;;) {
+        auto const entry = &compiler->constant_map[slot];
+        if (entry->index == -1) {
+            return -1;
+        }
+        if (constants_equal(entry->value, value)) {
+            return entry->index;
+        }
+        slot = (slot + 1) & (uint32_t)(compiler->constant_map_capacity - 1);
+    }
+}
+
+static void constant_map_insert(Compiler* const compiler, Value const value, int const index) {
+    if (compiler->constant_map_count + 1 > compiler->constant_map_capacity * 3 / 4) {
+        auto const old_capacity = compiler->constant_map_capacity;
+        auto const old_entries = compiler->constant_map;
+        compiler->constant_map_capacity = old_capacity < 16 ? 16 : old_capacity * 2;
+        compiler->constant_map =
+            (ConstantMapEntry*)arena_allocate(sizeof(ConstantMapEntry) * (size_t)compiler->constant_map_capacity);
+        for (auto i = 0; i < compiler->constant_map_capacity; ++i) {
+            compiler->constant_map[i].index = -1;
+        }
+        compiler->constant_map_count = 0;
+        for (auto i = 0; i < old_capacity; ++i) {
+            if (old_entries[i].index != -1) {
+                constant_map_insert(compiler, old_entries[i].value, old_entries[i].index);
+            }
+        }
+        // The old block is abandoned to the arena.
+    }
+
+    auto slot = hash_constant(value) & (uint32_t)(compiler->constant_map_capacity - 1);
+    while (compiler->constant_map[slot].index != -1) {
+        slot = (slot + 1) & (uint32_t)(compiler->constant_map_capacity - 1);
+    }
+    compiler->constant_map[slot].value = value;
+    compiler->constant_map[slot].index = index;
+    ++compiler->constant_map_count;
+}
+
+[[nodiscard]] static bool identifiers_equal(Token const* a, Token const* b);
+
+[[nodiscard]] static uint32_t hash_identifier(Token const* const name) {
+    return (uint32_t)hash_string(name->start, name->length);
+}
+
+// Slot holding the innermost local named `name`, or nullptr when the name has
+// no entry. Vacated slots (index -1) keep their name so probe chains stay
+// intact; finding one still identifies the name's slot.
+[[nodiscard]] static ScopeMapEntry* scope_map_find(Compiler const* const compiler, Token const* const name) {
+    if (compiler->scope_map_capacity == 0) {
+        return nullptr;
+    }
+    auto slot = hash_identifier(name) & (uint32_t)(compiler->scope_map_capacity - 1);
+    for (;;) {
+        auto const entry = &compiler->scope_map[slot];
+        if (entry->index == -1 and entry->name.length == 0) {
+            return nullptr;
+        }
+        if (identifiers_equal(name, &entry->name)) {
+            return entry;
+        }
+        slot = (slot + 1) & (uint32_t)(compiler->scope_map_capacity - 1);
+    }
+}
+
+// Binds `name` to local slot `index`, returning the index it shadowed (-1 if
+// none) so the caller can stash it for restoration on scope exit.
+[[nodiscard]] static int scope_map_bind(Compiler* const compiler, Token const name, int const index) {
+    if (compiler->scope_map_count + 1 > compiler->scope_map_capacity * 3 / 4) {
+        auto const old_capacity = compiler->scope_map_capacity;
+        auto const old_entries = compiler->scope_map;
+        compiler->scope_map_capacity = old_capacity < 16 ? 16 : old_capacity * 2;
+        compiler->scope_map =
+            (ScopeMapEntry*)arena_allocate(sizeof(ScopeMapEntry) * (size_t)compiler->scope_map_capacity);
+        for (auto i = 0; i < compiler->scope_map_capacity; ++i) {
+            compiler->scope_map[i].index = -1;
+            compiler->scope_map[i].name.length = 0;
+        }
+        compiler->scope_map_count = 0;
+        for (auto i = 0; i < old_capacity; ++i) {
+            // Vacated slots only existed to keep probe chains intact; the
+            // rehash rebuilds the chains, so they are dropped here.
+            if (old_entries[i].index != -1) {
+                (void)scope_map_bind(compiler, old_entries[i].name, old_entries[i].index);
+            }
+        }
+        // The old block is abandoned to the arena.
+    }
+
+    auto slot = hash_identifier(&name) & (uint32_t)(compiler->scope_map_capacity - 1);
+    for (;;) {
+        auto const entry = &compiler->scope_map[slot];
+        if (entry->index == -1 and entry->name.length == 0) {
+            entry->name = name;
+            entry->index = index;
+            ++compiler->scope_map_count;
+            return -1;
+        }
+        if (identifiers_equal(&name, &entry->name)) {
+            auto const shadowed = entry->index;
+            entry->index = index;
+            return shadowed;
+        }
+        slot = (slot + 1) & (uint32_t)(compiler->scope_map_capacity - 1);
+    }
+}
+
+// Adds the value to the chunk's constant pool, returning the index of an
+// existing entry instead of appending a duplicate. Deduplication happens here
+// rather than in add_constant() because the bytecode loader also goes through
+// add_constant() and must reproduce pool indices exactly as serialized.
 [[nodiscard]] static int make_constant(Value const value) {
-    auto const constant_index = add_constant(current_chunk(), value);
+    auto const existing = constant_map_find(current, value);
+    if (existing != -1) {
+        return existing;
+    }
+    auto const constant_index = add_constant(current_vm, current_chunk(), value);
+    constant_map_insert(current, value, constant_index);
     return constant_index;
 }
 
 static void emit_constant(Value const value) {
     auto const constant_index = make_constant(value);
     if (constant_index <= UINT8_MAX) {
+        record_instruction();
         emit_bytes(OP_CONSTANT, (uint8_t)constant_index);
     } else {
         emit_byte(OP_CONSTANT_LONG);
@@ -200,6 +482,9 @@ static void patch_jump(int const offset) {
 
     current_chunk()->code[offset] = (uint8_t)((jump_distance >> 8) & 0xFF);
     current_chunk()->code[offset + 1] = (uint8_t)(jump_distance & 0xFF);
+    // The jump lands on the next emitted instruction, so nothing may be fused
+    // across this point.
+    invalidate_peephole();
 }
 
 static void init_compiler(Compiler* const compiler, FunctionType const type) {
@@ -208,26 +493,113 @@ static void init_compiler(Compiler* const compiler, FunctionType const type) {
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = new_function();
+    compiler->last_instruction = -1;
+    compiler->previous_instruction = -1;
+    compiler->earlier_instruction = -1;
+    compiler->constant_map = nullptr;
+    compiler->constant_map_count = 0;
+    compiler->constant_map_capacity = 0;
+    compiler->scope_map = nullptr;
+    compiler->scope_map_count = 0;
+    compiler->scope_map_capacity = 0;
+    compiler->function = new_function(current_vm);
     current = compiler;
     if (type != TYPE_SCRIPT) {
-        current->function->name = copy_string(parser.previous.start, parser.previous.length);
+        current->function->name = copy_string(current_vm, parser.previous.start, parser.previous.length);
     }
 
+    // The synthetic slot-0 local is unnamed and never resolved, so it stays
+    // out of the scope map.
     auto const local = &current->locals[current->local_count++];
     local->depth = 0;
     local->is_captured = false;
     local->name.start = "";
     local->name.length = 0;
+    local->shadowed = -1;
+}
+
+// ==== Post-compile optimization pass =========================================
+
+[[nodiscard]] static int read_jump_operand(Chunk const* const chunk, int const operand_offset) {
+    return (chunk->code[operand_offset] << 8) | chunk->code[operand_offset + 1];
+}
+
+static void write_jump_operand(Chunk* const chunk, int const operand_offset, int const distance) {
+    chunk->code[operand_offset] = (uint8_t)((distance >> 8) & 0xFF);
+    chunk->code[operand_offset + 1] = (uint8_t)(distance & 0xFF);
+}
+
+// Follows a chain of unconditional forward jumps starting at `target` to its
+// final destination. Forward targets strictly increase, so this terminates.
+[[nodiscard]] static int thread_jump_target(Chunk const* const chunk, int target) {
+    while (target < chunk->count and chunk->code[target] == OP_JUMP) {
+        target = target + 3 + read_jump_operand(chunk, target + 1);
+    }
+    return target;
+}
+
+// Runs over the finished chunk before it is handed out: threads jumps whose
+// target is another unconditional jump straight to the final destination and
+// collapses the jump-over-jump pattern (from `or` lowering) into an inverted
+// conditional. Everything happens in place, so no offset shifts and the line
+// runs stay valid; unreachable code is left where it is, since it never
+// executes and removing it would mean relocating every jump across it.
+static void optimize_chunk(Chunk* const chunk) {
+    for (auto offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        switch ((OpCode)chunk->code[offset]) {
+            case OP_JUMP_IF_FALSE: {
+                // `JUMP_IF_FALSE +3` over an unconditional jump only exists
+                // to invert the condition — do that directly. The skipped
+                // jump becomes a fall-through (distance 0) on the false path.
+                if (read_jump_operand(chunk, offset + 1) == 3 and offset + 3 < chunk->count
+                    and chunk->code[offset + 3] == OP_JUMP) {
+                    auto const target = thread_jump_target(chunk, offset + 6 + read_jump_operand(chunk, offset + 4));
+                    auto const distance = target - (offset + 3);
+                    if (distance <= UINT16_MAX) {
+                        chunk->code[offset] = OP_JUMP_IF_TRUE;
+                        write_jump_operand(chunk, offset + 1, distance);
+                        write_jump_operand(chunk, offset + 4, 0);
+                        break;
+                    }
+                }
+            }
+                [[fallthrough]];
+            case OP_JUMP:
+            case OP_JUMP_IF_TRUE:
+            case OP_LESS_JUMP_IF_FALSE: {
+                auto const target = thread_jump_target(chunk, offset + 3 + read_jump_operand(chunk, offset + 1));
+                auto const distance = target - (offset + 3);
+                if (distance <= UINT16_MAX) {
+                    write_jump_operand(chunk, offset + 1, distance);
+                }
+                break;
+            }
+            case OP_LOOP: {
+                auto const target = thread_jump_target(chunk, offset + 3 - read_jump_operand(chunk, offset + 1));
+                auto const distance = (offset + 3) - target;
+                if (distance >= 0 and distance <= UINT16_MAX) {
+                    write_jump_operand(chunk, offset + 1, distance);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
 }
 
 static ObjFunction* end_compiler() {
     emit_return();
     auto const function = current->function;
+    // The constant and scope maps live in the arena, released wholesale when
+    // the top-level compilation finishes.
+    if (not parser.had_error) {
+        optimize_chunk(current_chunk());
+    }
 
 #ifdef DEBUG_PRINT_CODE
     if (not parser.had_error) {
-        disassemble_chunk(current_chunk(), function->name != nullptr ? function->name->chars : "<script>");
+        disassemble_chunk(current_vm, current_chunk(), function->name != nullptr ? function->name->chars : "<script>");
     }
 #endif
 
@@ -243,11 +615,15 @@ static void end_scope() {
     --current->scope_depth;
 
     while (current->local_count > 0 and current->locals[current->local_count - 1].depth > current->scope_depth) {
-        if (current->locals[current->local_count - 1].is_captured) {
+        auto const local = &current->locals[current->local_count - 1];
+        if (local->is_captured) {
             emit_byte(OP_CLOSE_UPVALUE);
         } else {
             emit_byte(OP_POP);
         }
+        // Restore the binding this local shadowed (or -1, vacating the slot).
+        // The entry exists because add_local() bound it.
+        scope_map_find(current, &local->name)->index = local->shadowed;
         --current->local_count;
     }
 }
@@ -258,19 +634,149 @@ static void declaration();
 [[nodiscard]] static ParseRule const* get_rule(TokenType type);
 static void parse_precedence(Precedence precedence);
 
+// Emits OP_ADD, fusing two immediately preceding local loads into
+// OP_ADD_LOCALS, or a preceding constant load into OP_ADD_CONSTANT.
+static void emit_add() {
+    auto const chunk = current_chunk();
+    auto const last = current->last_instruction;
+    auto const previous = current->previous_instruction;
+    if (instruction_at(last, OP_GET_LOCAL, 1) and previous == last - 2 and chunk->code[previous] == OP_GET_LOCAL) {
+        chunk->code[previous] = OP_ADD_LOCALS;
+        chunk->code[previous + 2] = chunk->code[last + 1];
+        --chunk->count;
+        invalidate_peephole();
+        return;
+    }
+    if (instruction_at(last, OP_CONSTANT, 1)) {
+        // Rewritten in place, so the tracker stays valid and emit_pop() can
+        // fuse further when this add turns out to be a counter update.
+        chunk->code[last] = OP_ADD_CONSTANT;
+        return;
+    }
+    emit_byte(OP_ADD);
+}
+
+// Emits OP_LESS, folding an immediately preceding constant load into
+// OP_LESS_CONSTANT.
+static void emit_less() {
+    if (instruction_at(current->last_instruction, OP_CONSTANT, 1)) {
+        current_chunk()->code[current->last_instruction] = OP_LESS_CONSTANT;
+        invalidate_peephole();
+        return;
+    }
+    record_instruction();
+    emit_byte(OP_LESS);
+}
+
+static void emit_constant(Value value);
+
+// Folds a binary operator applied to two immediately preceding number
+// constants down to a single constant load (or OP_TRUE/OP_FALSE for
+// comparisons). Division by zero is folded to infinity, matching what the
+// runtime would produce. Returns false if the operands aren't foldable.
+[[nodiscard]] static bool try_fold_binary(TokenType const operator_type) {
+    auto const chunk = current_chunk();
+    auto const last = current->last_instruction;
+    auto const previous = current->previous_instruction;
+    if (not instruction_at(last, OP_CONSTANT, 1) or previous != last - 2 or chunk->code[previous] != OP_CONSTANT) {
+        return false;
+    }
+    auto const a = chunk->constants.values[chunk->code[previous + 1]];
+    auto const b = chunk->constants.values[chunk->code[last + 1]];
+    if (not IS_NUMBER(a) or not IS_NUMBER(b)) {
+        return false;
+    }
+    auto const lhs = AS_NUMBER(a);
+    auto const rhs = AS_NUMBER(b);
+
+    Value folded;
+    // clang-format off
+    switch (operator_type) {
+        case TOKEN_PLUS:          folded = NUMBER_VAL(lhs + rhs); break;
+        case TOKEN_MINUS:         folded = NUMBER_VAL(lhs - rhs); break;
+        case TOKEN_STAR:          folded = NUMBER_VAL(lhs * rhs); break;
+        case TOKEN_SLASH:         folded = NUMBER_VAL(lhs / rhs); break;
+        case TOKEN_GREATER:       folded = BOOL_VAL(lhs > rhs);   break;
+        case TOKEN_GREATER_EQUAL: folded = BOOL_VAL(lhs >= rhs);  break;
+        case TOKEN_LESS:          folded = BOOL_VAL(lhs < rhs);   break;
+        case TOKEN_LESS_EQUAL:    folded = BOOL_VAL(lhs <= rhs);  break;
+        case TOKEN_EQUAL_EQUAL:   folded = BOOL_VAL(lhs == rhs);  break;
+        case TOKEN_BANG_EQUAL:    folded = BOOL_VAL(lhs != rhs);  break;
+        default: return false;
+    }
+    // clang-format on
+
+    truncate_chunk(chunk, previous);
+    invalidate_peephole();
+    if (IS_NUMBER(folded)) {
+        emit_constant(folded);
+    } else {
+        emit_byte(AS_BOOL(folded) ? OP_TRUE : OP_FALSE);
+    }
+    return true;
+}
+
+// Emits OP_NEGATE, folding an immediately preceding number constant into a
+// negated constant load.
+static void emit_negate() {
+    if (instruction_at(current->last_instruction, OP_CONSTANT, 1)) {
+        auto const chunk = current_chunk();
+        auto const operand = chunk->constants.values[chunk->code[current->last_instruction + 1]];
+        if (IS_NUMBER(operand)) {
+            truncate_chunk(chunk, current->last_instruction);
+            invalidate_peephole();
+            emit_constant(NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+    emit_byte(OP_NEGATE);
+}
+
+// Emits OP_POP for a discarded statement value, fusing an immediately
+// preceding local store into OP_SET_LOCAL_POP. The counter-update pattern
+// `local = local + constant;` — three instructions plus the pop — collapses
+// into a single OP_INCREMENT_LOCAL that never touches the stack. This is only
+// sound here, where the assignment's value is known to be discarded.
+static void emit_pop() {
+    auto const chunk = current_chunk();
+    auto const last = current->last_instruction;
+    auto const previous = current->previous_instruction;
+    auto const earlier = current->earlier_instruction;
+    if (instruction_at(last, OP_SET_LOCAL, 1) and previous == last - 2 and chunk->code[previous] == OP_ADD_CONSTANT
+        and earlier == previous - 2 and chunk->code[earlier] == OP_GET_LOCAL
+        and chunk->code[earlier + 1] == chunk->code[last + 1]) {
+        auto const slot = chunk->code[last + 1];
+        auto const constant_index = chunk->code[previous + 1];
+        truncate_chunk(chunk, earlier);
+        invalidate_peephole();
+        emit_byte(OP_INCREMENT_LOCAL);
+        emit_bytes(slot, constant_index);
+        return;
+    }
+    if (instruction_at(last, OP_SET_LOCAL, 1)) {
+        chunk->code[last] = OP_SET_LOCAL_POP;
+        invalidate_peephole();
+        return;
+    }
+    emit_byte(OP_POP);
+}
+
 static void binary(bool) {
     auto const operator_type = parser.previous.type;
     auto const rule = get_rule(operator_type);
     parse_precedence((Precedence)(rule->precedence + 1));
+    if (try_fold_binary(operator_type)) {
+        return;
+    }
     // clang-format off
     switch (operator_type) {
         case TOKEN_BANG_EQUAL:    emit_bytes(OP_EQUAL, OP_NOT);   break;
         case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL);            break;
         case TOKEN_GREATER:       emit_byte(OP_GREATER);          break;
         case TOKEN_GREATER_EQUAL: emit_bytes(OP_LESS, OP_NOT);    break;
-        case TOKEN_LESS:          emit_byte(OP_LESS);             break;
+        case TOKEN_LESS:          emit_less();                    break;
         case TOKEN_LESS_EQUAL:    emit_bytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emit_byte(OP_ADD);              break;
+        case TOKEN_PLUS:          emit_add();                     break;
         case TOKEN_MINUS:         emit_byte(OP_SUBTRACT);         break;
         case TOKEN_STAR:          emit_byte(OP_MULTIPLY);         break;
         case TOKEN_SLASH:         emit_byte(OP_DIVIDE);           break;
@@ -296,9 +802,40 @@ static void binary(bool) {
 
 static void call(bool) {
     auto const arg_count = argument_list();
+    // Recorded so that return_statement() can recognize a call in tail
+    // position and patch it into OP_TAIL_CALL.
+    record_instruction();
     emit_bytes(OP_CALL, arg_count);
 }
 
+static void list_literal(bool) {
+    // The elements are compiled onto the stack; OP_LIST pops them into the
+    // fresh list.
+    auto element_count = 0;
+    if (not check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (element_count == 255) {
+                error("Can't have more than 255 elements in a list literal.");
+            }
+            ++element_count;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emit_bytes(OP_LIST, (uint8_t)element_count);
+}
+
+static void subscript(bool const can_assign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+    if (can_assign and match(TOKEN_EQUAL)) {
+        expression();
+        emit_byte(OP_INDEX_SET);
+    } else {
+        emit_byte(OP_INDEX_GET);
+    }
+}
+
 static void literal(bool) {
     // clang-format off
     switch (parser.previous.type) {
@@ -339,10 +876,10 @@ static void and_(bool) {
 }
 
 static void string(bool) {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+    emit_constant(OBJ_VAL(copy_string(current_vm, parser.previous.start + 1, parser.previous.length - 2)));
 }
 
-[[nodiscard]] static uint8_t identifier_constant(Token const* name);
+[[nodiscard]] static uint8_t global_slot(Token const* name);
 [[nodiscard]] static int resolve_local(Compiler const* compiler, Token const* name);
 [[nodiscard]] static int resolve_upvalue(Compiler* compiler, Token const* name);
 
@@ -358,7 +895,7 @@ static void named_variable(Token const name, bool const can_assign) {
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(&name);
+        arg = global_slot(&name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
@@ -367,8 +904,14 @@ static void named_variable(Token const name, bool const can_assign) {
 
     if (can_assign and match(TOKEN_EQUAL)) {
         expression();
+        if (set_op == OP_SET_LOCAL) {
+            record_instruction();
+        }
         emit_bytes(set_op, (uint8_t)arg);
     } else {
+        if (get_op == OP_GET_LOCAL) {
+            record_instruction();
+        }
         emit_bytes(get_op, (uint8_t)arg);
     }
 }
@@ -386,8 +929,8 @@ static void unary(bool) {
     // Emit the operator instruction.
     // clang-format off
     switch (operator_type) {
-        case TOKEN_BANG:  emit_byte(OP_NOT);    break;
-        case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
+        case TOKEN_BANG:  emit_byte(OP_NOT); break;
+        case TOKEN_MINUS: emit_negate();     break;
         default: return; // Unreachable.
     }
     // clang-format on
@@ -399,6 +942,8 @@ static ParseRule const rules[] = {
     [TOKEN_RIGHT_PAREN]   = { nullptr,  nullptr, PREC_NONE       },
     [TOKEN_LEFT_BRACE]    = { nullptr,  nullptr, PREC_NONE       },
     [TOKEN_RIGHT_BRACE]   = { nullptr,  nullptr, PREC_NONE       },
+    [TOKEN_LEFT_BRACKET]  = { list_literal, subscript, PREC_CALL },
+    [TOKEN_RIGHT_BRACKET] = { nullptr,  nullptr, PREC_NONE       },
     [TOKEN_COMMA]         = { nullptr,  nullptr, PREC_NONE       },
     [TOKEN_DOT]           = { nullptr,  nullptr, PREC_NONE       },
     [TOKEN_MINUS]         = { unary,    binary,  PREC_TERM       },
@@ -461,12 +1006,15 @@ static void parse_precedence(Precedence const precedence) {
     }
 }
 
-[[nodiscard]] static uint8_t identifier_constant(Token const* const name) {
-    // Since we allow higher constant indices than 255, this must also be handled here.
-    // TODO: Gracefully handle higher indices.
-    auto const constant_index = make_constant(OBJ_VAL(copy_string(name->start, name->length)));
-    assert(constant_index >= 0 and constant_index <= UINT8_MAX and "Not implemented.");
-    return (uint8_t)constant_index;
+[[nodiscard]] static uint8_t global_slot(Token const* const name) {
+    // Globals get a stable slot in the VM's global array; the name table is
+    // only consulted here at compile time, never per access.
+    auto const slot = resolve_global_slot(current_vm, copy_string(current_vm, name->start, name->length));
+    if (slot > UINT8_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint8_t)slot;
 }
 
 [[nodiscard]] static bool identifiers_equal(Token const* const a, Token const* const b) {
@@ -477,16 +1025,16 @@ static void parse_precedence(Precedence const precedence) {
 }
 
 [[nodiscard]] static int resolve_local(Compiler const* const compiler, Token const* const name) {
-    for (auto i = compiler->local_count - 1; i >= 0; --i) {
-        auto const local = &compiler->locals[i];
-        if (identifiers_equal(name, &local->name)) {
-            if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
-            }
-            return i;
-        }
+    // The scope map always holds the innermost live binding, so resolution is
+    // a single probe instead of a backwards scan over all locals.
+    auto const entry = scope_map_find(compiler, name);
+    if (entry == nullptr or entry->index == -1) {
+        return -1;
     }
-    return -1;
+    if (compiler->locals[entry->index].depth == -1) {
+        error("Can't read local variable in its own initializer.");
+    }
+    return entry->index;
 }
 
 [[nodiscard]] static int add_upvalue(Compiler* const compiler, uint8_t const index, bool const is_local) {
@@ -534,10 +1082,12 @@ static void add_local(Token const name) {
         return;
     }
 
-    auto const local = &current->locals[current->local_count++];
+    auto const local = &current->locals[current->local_count];
     local->name = name;
     local->depth = -1;  // Special sentinel value to mark the variable as "uninitialized".
     local->is_captured = false;
+    local->shadowed = scope_map_bind(current, name, current->local_count);
+    ++current->local_count;
 }
 
 static void declare_variable() {
@@ -548,13 +1098,12 @@ static void declare_variable() {
 
     auto const name = &parser.previous;
 
-    for (auto i = current->local_count - 1; i >= 0; --i) {
-        auto const local = &current->locals[i];
-        if (local->depth != -1 and local->depth < current->scope_depth) {
-            break;
-        }
-
-        if (identifiers_equal(name, &local->name)) {
+    // Only the innermost binding can collide, and the scope map holds exactly
+    // that one. An uninitialized binding (depth -1) is in this scope too.
+    auto const entry = scope_map_find(current, name);
+    if (entry != nullptr and entry->index != -1) {
+        auto const local = &current->locals[entry->index];
+        if (local->depth == -1 or local->depth == current->scope_depth) {
             error("Already a variable with this name in this scope.");
         }
     }
@@ -571,7 +1120,7 @@ static void declare_variable() {
         return 0;
     }
 
-    return identifier_constant(&parser.previous);
+    return global_slot(&parser.previous);
 }
 
 static void mark_initialized() {
@@ -657,7 +1206,7 @@ static void var_declaration() {
 static void expression_statement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(OP_POP);
+    emit_pop();
 }
 
 static void for_statement() {
@@ -671,6 +1220,7 @@ static void for_statement() {
         expression_statement();
     }
 
+    invalidate_peephole();
     auto loop_start = current_chunk()->count;
     auto exit_jump = -1;
     if (not match(TOKEN_SEMICOLON)) {
@@ -686,7 +1236,7 @@ static void for_statement() {
         auto const body_jump = emit_jump(OP_JUMP);
         auto const increment_start = current_chunk()->count;
         expression();
-        emit_byte(OP_POP);
+        emit_pop();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emit_loop(loop_start);
@@ -740,11 +1290,20 @@ static void return_statement() {
     } else {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // A call whose result is returned directly is a tail call: the
+        // current frame is done, so the callee can reuse it and recursion in
+        // tail position runs in constant stack depth. The OP_RETURN below
+        // only executes when the callee turns out to be a native.
+        if (instruction_at(current->last_instruction, OP_CALL, 1)) {
+            current_chunk()->code[current->last_instruction] = OP_TAIL_CALL;
+            invalidate_peephole();
+        }
         emit_byte(OP_RETURN);
     }
 }
 
 static void while_statement() {
+    invalidate_peephole();
     auto const loop_start = current_chunk()->count;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
@@ -818,7 +1377,8 @@ static void statement() {
     }
 }
 
-[[nodiscard]] ObjFunction* compile(char const* const source) {
+[[nodiscard]] ObjFunction* compile(VM* const vm, char const* const source) {
+    current_vm = vm;
     init_scanner(source);
     Compiler compiler;
     init_compiler(&compiler, TYPE_SCRIPT);
@@ -835,5 +1395,17 @@ static void statement() {
     consume(TOKEN_EOF, "Except end of expression.");
 
     auto const function = end_compiler();
+    arena_release();
     return parser.had_error ? nullptr : function;
 }
+
+void mark_compiler_roots(VM* const vm) {
+    // Only mark for the VM this thread is currently compiling into; another
+    // VM's collection must not touch this compiler chain.
+    if (vm != current_vm) {
+        return;
+    }
+    for (auto compiler = current; compiler != nullptr; compiler = compiler->enclosing) {
+        mark_object(vm, (Obj*)compiler->function);
+    }
+}
@@ -3,4 +3,5 @@
 #include "object.h"
 #include "vm.h"
 
-[[nodiscard]] ObjFunction* compile(char const* source);
+[[nodiscard]] ObjFunction* compile(VM* vm, char const* source);
+void mark_compiler_roots(VM* vm);
@@ -2,11 +2,12 @@
 #include <stdio.h>
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
-void disassemble_chunk(Chunk* const chunk, char const* const name) {
+void disassemble_chunk(VM const* const vm, Chunk* const chunk, char const* const name) {
     printf("== %s ==\n", name);
     for (auto offset = 0; offset < chunk->count;) {
-        offset = disassemble_instruction(chunk, offset);
+        offset = disassemble_instruction(vm, chunk, offset);
     }
 }
 
@@ -14,14 +15,16 @@ void disassemble_chunk(Chunk* const chunk, char const* const name) {
 [[nodiscard]] static int byte_instruction(char const* name, Chunk const* chunk, int offset);
 [[nodiscard]] static int jump_instruction(char const* name, int sign, Chunk const* chunk, int offset);
 [[nodiscard]] static int constant_instruction(char const* name, Chunk const* chunk, int offset);
+[[nodiscard]] static int global_instruction(VM const* vm, char const* name, Chunk const* chunk, int offset);
 [[nodiscard]] int constant_long_instruction(char const* name, Chunk const* chunk, int offset);
 
-int disassemble_instruction(Chunk const* const chunk, int offset) {
+int disassemble_instruction(VM const* const vm, Chunk const* const chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 and chunk->lines[offset] == chunk->lines[offset - 1]) {
+    auto const line = chunk_line(chunk, offset);
+    if (offset > 0 and line == chunk_line(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     auto const instruction = chunk->code[offset];
@@ -35,9 +38,9 @@ int disassemble_instruction(Chunk const* const chunk, int offset) {
         case OP_POP:           return simple_instruction("OP_POP", offset);
         case OP_GET_LOCAL:     return byte_instruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:     return byte_instruction("OP_SET_LOCAL", chunk, offset);
-        case OP_GET_GLOBAL:    return constant_instruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_DEFINE_GLOBAL: return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL:    return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL:    return global_instruction(vm, "OP_GET_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL: return global_instruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL:    return global_instruction(vm, "OP_SET_GLOBAL", chunk, offset);
         case OP_EQUAL:         return simple_instruction("OP_EQUAL", offset);
         case OP_GREATER:       return simple_instruction("OP_GREATER", offset);
         case OP_LESS:          return simple_instruction("OP_LESS", offset);
@@ -45,13 +48,18 @@ int disassemble_instruction(Chunk const* const chunk, int offset) {
         case OP_PRINT:         return simple_instruction("OP_PRINT", offset);
         case OP_JUMP:          return jump_instruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE: return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE:  return jump_instruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
         case OP_LOOP:          return jump_instruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:          return byte_instruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:     return byte_instruction("OP_TAIL_CALL", chunk, offset);
         case OP_CLOSURE: {
             ++offset;
             auto const constant = chunk->code[offset++];
             printf("%-16s %4d ", "OP_CLOSURE", constant);
+            // print_value() buffers; flushing right away keeps it in order
+            // with the surrounding printf() output.
             print_value(chunk->constants.values[constant]);
+            print_flush();
             printf("\n");
 
             auto const function = AS_FUNCTION(chunk->constants.values[constant]);
@@ -72,11 +80,33 @@ int disassemble_instruction(Chunk const* const chunk, int offset) {
         case OP_SET_UPVALUE:   return byte_instruction("OP_SET_UPVALUE", chunk, offset);
         case OP_CLOSE_UPVALUE: return simple_instruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:        return simple_instruction("OP_RETURN", offset);
+        case OP_LIST:          return byte_instruction("OP_LIST", chunk, offset);
+        case OP_INDEX_GET:     return simple_instruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:     return simple_instruction("OP_INDEX_SET", offset);
         case OP_ADD:           return simple_instruction("OP_ADD", offset);
         case OP_SUBTRACT:      return simple_instruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:      return simple_instruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:        return simple_instruction("OP_DIVIDE", offset);
         case OP_NOT:           return simple_instruction("OP_NOT", offset);
+        case OP_ADD_LOCALS: {
+            auto const slot_a = chunk->code[offset + 1];
+            auto const slot_b = chunk->code[offset + 2];
+            printf("%-16s %4d %4d\n", "OP_ADD_LOCALS", slot_a, slot_b);
+            return offset + 3;
+        }
+        case OP_SET_LOCAL_POP:       return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_LESS_CONSTANT:       return constant_instruction("OP_LESS_CONSTANT", chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:  return jump_instruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_ADD_CONSTANT:        return constant_instruction("OP_ADD_CONSTANT", chunk, offset);
+        case OP_INCREMENT_LOCAL: {
+            auto const slot = chunk->code[offset + 1];
+            auto const constant = chunk->code[offset + 2];
+            printf("%-16s %4d %4d '", "OP_INCREMENT_LOCAL", slot, constant);
+            print_value(chunk->constants.values[constant]);
+            print_flush();
+            printf("'\n");
+            return offset + 3;
+        }
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -106,14 +136,24 @@ int disassemble_instruction(Chunk const* const chunk, int offset) {
     auto const constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
     print_value(chunk->constants.values[constant]);
+    print_flush();
     printf("'\n");
     return offset + 2;
 }
 
+[[nodiscard]] static int
+    global_instruction(VM const* const vm, char const* const name, Chunk const* const chunk, int const offset) {
+    auto const slot = chunk->code[offset + 1];
+    auto const global_name = global_name_for_slot(vm, slot);
+    printf("%-16s %4d '%s'\n", name, slot, global_name != nullptr ? global_name->chars : "?");
+    return offset + 2;
+}
+
 [[nodiscard]] int constant_long_instruction(char const* const name, Chunk const* const chunk, int const offset) {
     auto const constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
     printf("%-16s %4d '", name, constant);
     print_value(chunk->constants.values[constant]);
+    print_flush();
     printf("'\n");
     return offset + 4;
 }
@@ -2,5 +2,5 @@
 
 #include "chunk.h"
 
-void disassemble_chunk(Chunk* chunk, const char* name);
-int disassemble_instruction(Chunk const* chunk, int offset);
+void disassemble_chunk(VM const* vm, Chunk* chunk, const char* name);
+int disassemble_instruction(VM const* vm, Chunk const* chunk, int offset);
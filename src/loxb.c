@@ -0,0 +1,637 @@
+#include "loxb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+#define LOXB_MAGIC 0x42584F4Cu  // "LOXB" when read as little-endian bytes.
+#define SNAPSHOT_MAGIC 0x53584F4Cu  // "LOXS" when read as little-endian bytes.
+// Shared by bytecode caches and snapshots, since both embed function graphs.
+#define LOXB_VERSION 7u
+
+typedef enum {
+    LOXB_CONST_NUMBER,
+    LOXB_CONST_NIL,
+    LOXB_CONST_TRUE,
+    LOXB_CONST_FALSE,
+    LOXB_CONST_STRING,
+    LOXB_CONST_FUNCTION,
+} LoxbConstantTag;
+
+[[nodiscard]] static bool write_bytes(FILE* const file, void const* const buffer, size_t const size) {
+    return fwrite(buffer, 1, size, file) == size;
+}
+
+[[nodiscard]] static bool read_bytes(FILE* const file, void* const buffer, size_t const size) {
+    return fread(buffer, 1, size, file) == size;
+}
+
+[[nodiscard]] static bool write_i32(FILE* const file, int32_t const value) {
+    return write_bytes(file, &value, sizeof(value));
+}
+
+[[nodiscard]] static bool read_i32(FILE* const file, int32_t* const value) {
+    return read_bytes(file, value, sizeof(*value));
+}
+
+[[nodiscard]] static bool write_u32(FILE* const file, uint32_t const value) {
+    return write_bytes(file, &value, sizeof(value));
+}
+
+[[nodiscard]] static bool read_u32(FILE* const file, uint32_t* const value) {
+    return read_bytes(file, value, sizeof(*value));
+}
+
+[[nodiscard]] static bool write_u64(FILE* const file, uint64_t const value) {
+    return write_bytes(file, &value, sizeof(value));
+}
+
+[[nodiscard]] static bool read_u64(FILE* const file, uint64_t* const value) {
+    return read_bytes(file, value, sizeof(*value));
+}
+
+[[nodiscard]] static bool write_function(FILE* file, ObjFunction const* function);
+
+// Not named write_constant to avoid clashing with the chunk API of the same
+// name.
+[[nodiscard]] static bool write_constant_entry(FILE* const file, Value const value) {
+    if (IS_NUMBER(value)) {
+        uint8_t const tag = LOXB_CONST_NUMBER;
+        auto const number = AS_NUMBER(value);
+        return write_bytes(file, &tag, 1) and write_bytes(file, &number, sizeof(number));
+    }
+    if (IS_NIL(value)) {
+        uint8_t const tag = LOXB_CONST_NIL;
+        return write_bytes(file, &tag, 1);
+    }
+    if (IS_BOOL(value)) {
+        uint8_t const tag = AS_BOOL(value) ? LOXB_CONST_TRUE : LOXB_CONST_FALSE;
+        return write_bytes(file, &tag, 1);
+    }
+    if (IS_STRING(value)) {
+        uint8_t const tag = LOXB_CONST_STRING;
+        auto const string = AS_STRING(value);
+        return write_bytes(file, &tag, 1) and write_i32(file, string->length)
+               and write_bytes(file, string->chars, (size_t)string->length);
+    }
+    if (IS_FUNCTION(value)) {
+        uint8_t const tag = LOXB_CONST_FUNCTION;
+        return write_bytes(file, &tag, 1) and write_function(file, AS_FUNCTION(value));
+    }
+    // No other value kinds ever end up in a constant pool.
+    return false;
+}
+
+[[nodiscard]] static bool write_function(FILE* const file, ObjFunction const* const function) {
+    if (not write_i32(file, function->arity) or not write_i32(file, function->upvalue_count)) {
+        return false;
+    }
+
+    if (function->name == nullptr) {
+        if (not write_i32(file, -1)) {
+            return false;
+        }
+    } else {
+        if (not write_i32(file, function->name->length)
+            or not write_bytes(file, function->name->chars, (size_t)function->name->length)) {
+            return false;
+        }
+    }
+
+    auto const chunk = &function->chunk;
+    if (not write_i32(file, chunk->count) or not write_bytes(file, chunk->code, (size_t)chunk->count)
+        or not write_i32(file, chunk->line_run_count)
+        or not write_bytes(file, chunk->line_runs, sizeof(LineRun) * (size_t)chunk->line_run_count)) {
+        return false;
+    }
+
+    if (not write_i32(file, chunk->constants.count)) {
+        return false;
+    }
+    for (auto i = 0; i < chunk->constants.count; ++i) {
+        if (not write_constant_entry(file, chunk->constants.values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads a function graph, keeping every partially built function reachable
+// from the stack so a collection during loading cannot sweep it away. Returns
+// nullptr on malformed input; anything built up to that point is left to the
+// GC.
+[[nodiscard]] static ObjFunction* read_function(VM* const vm, FILE* const file) {
+    auto const function = new_function(vm);
+    push(vm, OBJ_VAL(function));
+
+    int32_t name_length;
+    if (not read_i32(file, &function->arity) or not read_i32(file, &function->upvalue_count)
+        or not read_i32(file, &name_length)) {
+        goto fail;
+    }
+
+    if (name_length >= 0) {
+        auto const name_buffer = (char*)malloc((size_t)name_length);
+        if (name_buffer == nullptr or not read_bytes(file, name_buffer, (size_t)name_length)) {
+            free(name_buffer);
+            goto fail;
+        }
+        function->name = copy_string(vm, name_buffer, name_length);
+        free(name_buffer);
+    }
+
+    auto const chunk = &function->chunk;
+    int32_t code_count;
+    if (not read_i32(file, &code_count) or code_count < 0) {
+        goto fail;
+    }
+    chunk->code = GROW_ARRAY(vm, uint8_t, nullptr, 0, code_count);
+    chunk->count = code_count;
+    chunk->capacity = code_count;
+    if (not read_bytes(file, chunk->code, (size_t)code_count)) {
+        goto fail;
+    }
+
+    int32_t line_run_count;
+    if (not read_i32(file, &line_run_count) or line_run_count < 0) {
+        goto fail;
+    }
+    chunk->line_runs = GROW_ARRAY(vm, LineRun, nullptr, 0, line_run_count);
+    chunk->line_run_count = line_run_count;
+    chunk->line_run_capacity = line_run_count;
+    if (not read_bytes(file, chunk->line_runs, sizeof(LineRun) * (size_t)line_run_count)) {
+        goto fail;
+    }
+
+    int32_t constants_count;
+    if (not read_i32(file, &constants_count) or constants_count < 0) {
+        goto fail;
+    }
+    for (auto i = 0; i < constants_count; ++i) {
+        uint8_t tag;
+        if (not read_bytes(file, &tag, 1)) {
+            goto fail;
+        }
+        switch (tag) {
+            case LOXB_CONST_NUMBER: {
+                double number;
+                if (not read_bytes(file, &number, sizeof(number))) {
+                    goto fail;
+                }
+                (void)add_constant(vm, chunk, NUMBER_VAL(number));
+                break;
+            }
+            case LOXB_CONST_NIL:
+                (void)add_constant(vm, chunk, NIL_VAL);
+                break;
+            case LOXB_CONST_TRUE:
+                (void)add_constant(vm, chunk, BOOL_VAL(true));
+                break;
+            case LOXB_CONST_FALSE:
+                (void)add_constant(vm, chunk, BOOL_VAL(false));
+                break;
+            case LOXB_CONST_STRING: {
+                int32_t length;
+                if (not read_i32(file, &length) or length < 0) {
+                    goto fail;
+                }
+                auto const buffer = (char*)malloc((size_t)length + 1);
+                if (buffer == nullptr or not read_bytes(file, buffer, (size_t)length)) {
+                    free(buffer);
+                    goto fail;
+                }
+                (void)add_constant(vm, chunk, OBJ_VAL(copy_string(vm, buffer, length)));
+                free(buffer);
+                break;
+            }
+            case LOXB_CONST_FUNCTION: {
+                auto const nested = read_function(vm, file);
+                if (nested == nullptr) {
+                    goto fail;
+                }
+                (void)add_constant(vm, chunk, OBJ_VAL(nested));
+                break;
+            }
+            default:
+                goto fail;
+        }
+    }
+
+    (void)pop(vm);
+    return function;
+
+fail:
+    (void)pop(vm);
+    return nullptr;
+}
+
+// ==== VM state snapshots =====================================================
+
+typedef enum {
+    SNAP_UNDEFINED,  // a slot that was resolved but never assigned
+    SNAP_NIL,
+    SNAP_TRUE,
+    SNAP_FALSE,
+    SNAP_NUMBER,
+    SNAP_STRING,
+    SNAP_FUNCTION,
+    SNAP_CLOSURE,  // an upvalue-free closure, stored as its function
+    SNAP_NATIVE,  // presence only; the restored VM keeps its own binding
+    SNAP_LIST,
+    SNAP_MAP,
+} SnapshotTag;
+
+[[nodiscard]] static bool write_tag(FILE* const file, SnapshotTag const tag) {
+    uint8_t const byte = (uint8_t)tag;
+    return write_bytes(file, &byte, 1);
+}
+
+[[nodiscard]] static bool write_string_entry(FILE* const file, ObjString const* const string) {
+    return write_i32(file, string->length) and write_bytes(file, string->chars, (size_t)string->length);
+}
+
+[[nodiscard]] static bool write_snapshot_value(FILE* const file, Value const value) {
+    if (IS_UNDEFINED(value)) {
+        return write_tag(file, SNAP_UNDEFINED);
+    }
+    if (IS_NIL(value)) {
+        return write_tag(file, SNAP_NIL);
+    }
+    if (IS_BOOL(value)) {
+        return write_tag(file, AS_BOOL(value) ? SNAP_TRUE : SNAP_FALSE);
+    }
+    if (IS_NUMBER(value)) {
+        auto const number = AS_NUMBER(value);
+        return write_tag(file, SNAP_NUMBER) and write_bytes(file, &number, sizeof(number));
+    }
+    if (IS_STRING(value)) {
+        return write_tag(file, SNAP_STRING) and write_string_entry(file, AS_STRING(value));
+    }
+    if (IS_FUNCTION(value)) {
+        return write_tag(file, SNAP_FUNCTION) and write_function(file, AS_FUNCTION(value));
+    }
+    if (IS_CLOSURE(value)) {
+        auto const closure = AS_CLOSURE(value);
+        // Captured upvalues would need the whole surrounding cell graph;
+        // top-level prelude functions never have any.
+        if (closure->upvalue_count != 0) {
+            return false;
+        }
+        return write_tag(file, SNAP_CLOSURE) and write_function(file, closure->function);
+    }
+    if (IS_NATIVE(value)) {
+        return write_tag(file, SNAP_NATIVE);
+    }
+    if (IS_LIST(value)) {
+        auto const list = AS_LIST(value);
+        if (not write_tag(file, SNAP_LIST) or not write_i32(file, list->items.count)) {
+            return false;
+        }
+        for (auto i = 0; i < list->items.count; ++i) {
+            if (not write_snapshot_value(file, list->items.values[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (IS_MAP(value)) {
+        auto const map = AS_MAP(value);
+        if (not write_tag(file, SNAP_MAP) or not write_i32(file, map->count)) {
+            return false;
+        }
+        for (auto i = 0; i < map->table.capacity; ++i) {
+            auto const entry = &map->table.entries[i];
+            if (IS_UNDEFINED(entry->key)) {
+                continue;
+            }
+            if (not write_snapshot_value(file, entry->key) or not write_snapshot_value(file, entry->value)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    // String builders and other transient objects have no stable
+    // serialization.
+    return false;
+}
+
+[[nodiscard]] static ObjString const* read_string_entry(VM* const vm, FILE* const file) {
+    int32_t length;
+    if (not read_i32(file, &length) or length < 0) {
+        return nullptr;
+    }
+    auto const buffer = (char*)malloc((size_t)length + 1);
+    if (buffer == nullptr or not read_bytes(file, buffer, (size_t)length)) {
+        free(buffer);
+        return nullptr;
+    }
+    auto const string = copy_string(vm, buffer, length);
+    free(buffer);
+    return string;
+}
+
+// Reads one tagged value. Everything built on the way stays reachable via
+// the VM stack while nested reads may allocate. SNAP_UNDEFINED and
+// SNAP_NATIVE read as UNDEFINED_VAL, which the caller treats as "leave the
+// slot alone".
+[[nodiscard]] static bool read_snapshot_value(VM* const vm, FILE* const file, Value* const out) {
+    uint8_t tag;
+    if (not read_bytes(file, &tag, 1)) {
+        return false;
+    }
+    switch (tag) {
+        case SNAP_UNDEFINED:
+        case SNAP_NATIVE:
+            *out = UNDEFINED_VAL;
+            return true;
+        case SNAP_NIL:
+            *out = NIL_VAL;
+            return true;
+        case SNAP_TRUE:
+            *out = BOOL_VAL(true);
+            return true;
+        case SNAP_FALSE:
+            *out = BOOL_VAL(false);
+            return true;
+        case SNAP_NUMBER: {
+            double number;
+            if (not read_bytes(file, &number, sizeof(number))) {
+                return false;
+            }
+            *out = NUMBER_VAL(number);
+            return true;
+        }
+        case SNAP_STRING: {
+            auto const string = read_string_entry(vm, file);
+            if (string == nullptr) {
+                return false;
+            }
+            *out = OBJ_VAL(string);
+            return true;
+        }
+        case SNAP_FUNCTION: {
+            auto const function = read_function(vm, file);
+            if (function == nullptr) {
+                return false;
+            }
+            *out = OBJ_VAL(function);
+            return true;
+        }
+        case SNAP_CLOSURE: {
+            auto const function = read_function(vm, file);
+            if (function == nullptr) {
+                return false;
+            }
+            push(vm, OBJ_VAL(function));
+            auto const closure = new_closure(vm, function);
+            (void)pop(vm);
+            *out = OBJ_VAL(closure);
+            return true;
+        }
+        case SNAP_LIST: {
+            int32_t count;
+            if (not read_i32(file, &count) or count < 0) {
+                return false;
+            }
+            auto const list = new_list(vm);
+            push(vm, OBJ_VAL(list));
+            for (auto i = 0; i < count; ++i) {
+                Value element;
+                if (not read_snapshot_value(vm, file, &element) or IS_UNDEFINED(element)) {
+                    (void)pop(vm);
+                    return false;
+                }
+                // Rooted while the buffer potentially grows.
+                push(vm, element);
+                write_value_array(vm, &list->items, element);
+                (void)pop(vm);
+            }
+            *out = pop(vm);
+            return true;
+        }
+        case SNAP_MAP: {
+            int32_t count;
+            if (not read_i32(file, &count) or count < 0) {
+                return false;
+            }
+            auto const map = new_map(vm);
+            push(vm, OBJ_VAL(map));
+            for (auto i = 0; i < count; ++i) {
+                Value key;
+                if (not read_snapshot_value(vm, file, &key) or IS_UNDEFINED(key)) {
+                    (void)pop(vm);
+                    return false;
+                }
+                push(vm, key);
+                Value value;
+                if (not read_snapshot_value(vm, file, &value) or IS_UNDEFINED(value)) {
+                    (void)pop(vm);
+                    (void)pop(vm);
+                    return false;
+                }
+                push(vm, value);
+                if (table_set(vm, &map->table, key, value)) {
+                    ++map->count;
+                }
+                (void)pop(vm);
+                (void)pop(vm);
+            }
+            *out = pop(vm);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+[[nodiscard]] bool loxb_write_snapshot(VM const* const vm, char const* const path) {
+    auto const file = fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    auto ok = write_u32(file, SNAPSHOT_MAGIC) and write_u32(file, LOXB_VERSION)
+              and write_i32(file, vm->global_values.count);
+    for (auto slot = 0; ok and slot < vm->global_values.count; ++slot) {
+        // Reverse lookups are quadratic over the globals, which is fine for
+        // a snapshot taken once after setup.
+        ok = write_string_entry(file, global_name_for_slot(vm, slot))
+             and write_snapshot_value(file, vm->global_values.values[slot]);
+    }
+
+    if (fclose(file) != 0 or not ok) {
+        // Never leave a truncated snapshot behind.
+        remove(path);
+        return false;
+    }
+    return true;
+}
+
+[[nodiscard]] bool loxb_read_snapshot(VM* const vm, char const* const path) {
+    auto const file = fopen(path, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    uint32_t magic;
+    uint32_t version;
+    int32_t global_count;
+    if (not read_u32(file, &magic) or magic != SNAPSHOT_MAGIC or not read_u32(file, &version)
+        or version != LOXB_VERSION or not read_i32(file, &global_count) or global_count < 0) {
+        fclose(file);
+        return false;
+    }
+
+    for (auto i = 0; i < global_count; ++i) {
+        auto const name = read_string_entry(vm, file);
+        if (name == nullptr) {
+            fclose(file);
+            return false;
+        }
+        auto const slot = resolve_global_slot(vm, name);
+        Value value;
+        if (not read_snapshot_value(vm, file, &value)) {
+            fclose(file);
+            return false;
+        }
+        // Undefined marks natives and never-assigned slots: the freshly
+        // initialized VM's own bindings win there.
+        if (not IS_UNDEFINED(value)) {
+            vm->global_values.values[slot] = value;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Rewrites every global-slot operand from the writer's numbering (resolved
+// against `slots`) to this VM's, recursing into nested functions. The cache
+// stores the slot indices the writing VM assigned; a VM whose resolution
+// order differs — one warmed by a snapshot, or a batch worker that compiled
+// other scripts first — would otherwise read or clobber unrelated globals.
+[[nodiscard]] static bool remap_global_slots(Chunk* const chunk, int32_t const* const slots, int32_t const slot_count) {
+    for (auto offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        switch ((OpCode)chunk->code[offset]) {
+            case OP_GET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_GLOBAL: {
+                auto const slot = chunk->code[offset + 1];
+                // A remapped slot beyond one operand byte means this VM
+                // already has more globals than the encoding can address;
+                // recompiling reports that properly.
+                if (slot >= slot_count or slots[slot] > UINT8_MAX) {
+                    return false;
+                }
+                chunk->code[offset + 1] = (uint8_t)slots[slot];
+                break;
+            }
+            case OP_CLOSURE: {
+                // instruction_length() decodes the operand list through the
+                // function constant; validate it before trusting the length.
+                auto const constant = chunk->code[offset + 1];
+                if (constant >= chunk->constants.count or not IS_FUNCTION(chunk->constants.values[constant])) {
+                    return false;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    for (auto i = 0; i < chunk->constants.count; ++i) {
+        auto const constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant) and not remap_global_slots(&AS_FUNCTION(constant)->chunk, slots, slot_count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+[[nodiscard]] bool
+    loxb_write(VM const* const vm, ObjFunction const* const function, char const* const path, uint64_t const source_hash) {
+    // Written to a sibling temporary and renamed into place, so a concurrent
+    // reader never sees a half-written cache — loaded bytecode runs without a
+    // verifier, so a torn file must not be observable at the final path. The
+    // exclusive "x" mode lets exactly one of several batch workers compiling
+    // the same script write; the losers (and anyone blocked by a temporary a
+    // crashed run left behind) just skip the write, which is best effort
+    // anyway.
+    auto const path_length = strlen(path);
+    auto const temp_path = (char*)malloc(path_length + strlen(".tmp") + 1);
+    if (temp_path == nullptr) {
+        return false;
+    }
+    memcpy(temp_path, path, path_length);
+    strcpy(temp_path + path_length, ".tmp");
+
+    auto const file = fopen(temp_path, "wbx");
+    if (file == nullptr) {
+        free(temp_path);
+        return false;
+    }
+
+    // The writer's slot→name table goes in front of the code so the loader
+    // can renumber the global operands for its own VM. Reverse lookups are
+    // quadratic over the globals, which is fine for a one-time cache write.
+    auto ok = write_u32(file, LOXB_MAGIC) and write_u32(file, LOXB_VERSION) and write_u64(file, source_hash)
+              and write_i32(file, vm->global_values.count);
+    for (auto slot = 0; ok and slot < vm->global_values.count; ++slot) {
+        ok = write_string_entry(file, global_name_for_slot(vm, slot));
+    }
+    ok = ok and write_function(file, function);
+
+    if (fclose(file) != 0 or not ok or rename(temp_path, path) != 0) {
+        // Never leave a truncated temporary behind.
+        remove(temp_path);
+        free(temp_path);
+        return false;
+    }
+    free(temp_path);
+    return true;
+}
+
+[[nodiscard]] ObjFunction* loxb_read(VM* const vm, char const* const path, uint64_t const source_hash) {
+    auto const file = fopen(path, "rb");
+    if (file == nullptr) {
+        return nullptr;
+    }
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    int32_t slot_count;
+    if (not read_u32(file, &magic) or magic != LOXB_MAGIC or not read_u32(file, &version)
+        or version != LOXB_VERSION or not read_u64(file, &hash) or hash != source_hash
+        or not read_i32(file, &slot_count) or slot_count < 0) {
+        fclose(file);
+        return nullptr;
+    }
+
+    // Resolve the writer's slots against this VM; new names get fresh
+    // UNDEFINED slots here, exactly as compiling the script would make them.
+    auto const slots = (int32_t*)malloc(sizeof(int32_t) * (size_t)slot_count);
+    if (slot_count > 0 and slots == nullptr) {
+        fclose(file);
+        return nullptr;
+    }
+    for (auto i = 0; i < slot_count; ++i) {
+        auto const name = read_string_entry(vm, file);
+        if (name == nullptr) {
+            free(slots);
+            fclose(file);
+            return nullptr;
+        }
+        slots[i] = resolve_global_slot(vm, name);
+    }
+
+    auto function = read_function(vm, file);
+    if (function != nullptr and not remap_global_slots(&function->chunk, slots, slot_count)) {
+        function = nullptr;  // Left to the GC, like any other malformed read.
+    }
+    free(slots);
+    fclose(file);
+    return function;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "object.h"
+
+// Serialization of a compiled ObjFunction graph (chunk code, line info,
+// constant pools, nested functions) to a versioned .loxb file, so that
+// repeated runs of the same script can skip the scanner and compiler
+// entirely. The format uses native endianness and is validated via a magic
+// number, a format version, and a hash of the source it was compiled from —
+// it is a per-machine cache, not an interchange format.
+
+// Global-slot operands are indices into the writing VM's global array, so the
+// file carries the writer's slot→name table and loxb_read() renumbers them
+// for the reading VM, which may have resolved globals in a different order.
+// Both return false/nullptr on I/O errors or (for loxb_read) on a
+// magic/version/source-hash mismatch; callers then fall back to compiling.
+[[nodiscard]] bool loxb_write(VM const* vm, ObjFunction const* function, char const* path, uint64_t source_hash);
+[[nodiscard]] ObjFunction* loxb_read(VM* vm, char const* path, uint64_t source_hash);
+
+// VM state snapshot: serializes every named global and the object graph
+// hanging off it (numbers, strings, lists, maps, compiled functions and
+// upvalue-free closures) to a .loxs file. Restoring into a freshly
+// initialized VM replays the globals — re-interning every string on the way
+// — so a prelude of helper definitions loads at file-read speed instead of
+// being recompiled. Native-function slots are recorded by presence only and
+// keep whatever init_vm() registered. Writing fails on values that cannot
+// be serialized (string builders, closures with captured upvalues).
+[[nodiscard]] bool loxb_write_snapshot(VM const* vm, char const* path);
+[[nodiscard]] bool loxb_read_snapshot(VM* vm, char const* path);
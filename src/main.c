@@ -2,26 +2,53 @@
 #include <stdlib.h>
 #include <string.h>
 #include "common.h"
+#include "compiler.h"
+#include "loxb.h"
+#include "object.h"
 #include "vm.h"
 
-static void repl() {
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_MMAP_SOURCES
+#define CLOX_UNIX_SOCKETS
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef __STDC_NO_THREADS__
+#define CLOX_THREADS
+#include <stdatomic.h>
+#include <threads.h>
+#endif
+
+static void repl(VM* const vm) {
     char line[1024];
     for (;;) {
+        // The previous line's buffered output must precede the prompt.
+        print_flush();
         printf("> ");
+        fflush(stdout);
         if (not fgets(line, sizeof(line), stdin)) {
             printf("\n");
             break;
         }
         // todo: evaluate return value
-        (void)interpret(line);
+        (void)interpret(vm, line);
     }
 }
 
+// Reports the failure and returns nullptr if the file cannot be read; a
+// batch worker must survive one bad manifest entry, so the exit(74) happens
+// in the callers that really are fatal.
 [[nodiscard]] static char* read_file(char const* const path) {
     auto const file = fopen(path, "rb");
     if (file == nullptr) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        return nullptr;
     }
     fseek(file, 0L, SEEK_END);
     auto const file_size = (size_t)ftell(file);
@@ -30,44 +57,426 @@ static void repl() {
     auto const buffer = (char*)malloc(file_size + 1);
     if (buffer == nullptr) {
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        fclose(file);
+        return nullptr;
     }
     auto const bytes_read = fread(buffer, sizeof(char), file_size, file);
     if (bytes_read < file_size) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        free(buffer);
+        fclose(file);
+        return nullptr;
     }
     buffer[bytes_read] = '\0';
     fclose(file);
     return buffer;
 }
 
-static void run_file(char const* const path) {
-    auto const source = read_file(path);
-    auto const result = interpret(source);
-    free(source);
+typedef struct {
+    char const* source;  // NUL-terminated script text.
+    size_t mapped_size;  // 0 when the source lives in malloc'd memory instead.
+} SourceFile;
+
+// Maps the script read-only so the page cache is shared across concurrent
+// processes running the same file and compilation doesn't hold a second copy
+// in memory. Falls back to read_file() for non-regular files (pipes), empty
+// files, failed mappings, and files whose size is an exact multiple of the
+// page size — the scanner needs the NUL sentinel that the zero-filled tail
+// of the last mapped page otherwise provides.
+[[nodiscard]] static SourceFile load_source(char const* const path) {
+#ifdef CLOX_MMAP_SOURCES
+    auto const fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        struct stat info;
+        auto const page_size = (size_t)sysconf(_SC_PAGESIZE);
+        if (fstat(fd, &info) == 0 and S_ISREG(info.st_mode) and info.st_size > 0
+            and (size_t)info.st_size % page_size != 0) {
+            auto const mapping = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapping != MAP_FAILED) {
+                return (SourceFile){ .source = (char const*)mapping, .mapped_size = (size_t)info.st_size };
+            }
+        } else {
+            close(fd);
+        }
+    }
+#endif
+    return (SourceFile){ .source = read_file(path), .mapped_size = 0 };
+}
+
+static void unload_source(SourceFile const file) {
+#ifdef CLOX_MMAP_SOURCES
+    if (file.mapped_size != 0) {
+        munmap((void*)file.source, file.mapped_size);
+        return;
+    }
+#endif
+    free((char*)file.source);
+}
+
+[[nodiscard]] static char* cache_path_for(char const* const path) {
+    auto const length = strlen(path) + strlen(".loxb") + 1;
+    auto const buffer = (char*)malloc(length);
+    if (buffer != nullptr) {
+        snprintf(buffer, length, "%s.loxb", path);
+    }
+    return buffer;
+}
+
+// Compiles (or loads from cache) and runs the script, returning the status
+// the process would exit with: 0, 65 (compile error), 70 (runtime error),
+// or 74 (the file could not be read).
+[[nodiscard]] static int run_script(VM* const vm, char const* const path) {
+    auto const file = load_source(path);
+    auto const source = file.source;
+    if (source == nullptr) {
+        return 74;
+    }
+    auto const source_hash = hash_string(source, (int)strlen(source));
+
+    auto const cache_path = cache_path_for(path);
+    auto function = cache_path == nullptr ? nullptr : loxb_read(vm, cache_path, source_hash);
+    if (function == nullptr) {
+        function = compile(vm, source);
+        if (function == nullptr) {
+            free(cache_path);
+            unload_source(file);
+            return 65;
+        }
+        if (cache_path != nullptr) {
+            // Best effort: failing to write the cache only costs the next run
+            // a recompile.
+            (void)loxb_write(vm, function, cache_path, source_hash);
+        }
+    }
+    free(cache_path);
+    unload_source(file);
+
+    auto const result = interpret_compiled(vm, function);
+    return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
+
+static void run_file(VM* const vm, char const* const path) {
+    auto const status = run_script(vm, path);
+    if (status != 0) {
+        exit(status);
+    }
+}
+
+#ifdef CLOX_THREADS
+
+typedef struct {
+    char const* const* paths;  // Job list, shared read-only across workers.
+    int count;
+    atomic_int next;          // Next unclaimed job index.
+    atomic_int failed;        // Jobs that finished with a non-zero status.
+    atomic_int worst_status;  // Highest status any job produced.
+} BatchQueue;
+
+// Claims jobs off the shared queue until it runs dry. Every job gets a fresh
+// VM: reusing one would leak globals between scripts, so whether a read of an
+// undefined variable fails would depend on what ran on the worker before.
+// Compiled chunks still carry over between identical scripts through the
+// .loxb cache. All compiler, profiler, and output-buffer state is
+// thread_local, so workers never contend on anything but the queue counters
+// and the stdio lock.
+static int batch_worker(void* const argument) {
+    auto const queue = (BatchQueue*)argument;
+
+    for (;;) {
+        auto const index = atomic_fetch_add_explicit(&queue->next, 1, memory_order_relaxed);
+        if (index >= queue->count) {
+            break;
+        }
+        VM vm;
+        init_vm(&vm);
+        auto const status = run_script(&vm, queue->paths[index]);
+        free_vm(&vm);  // Flushes the output buffer at the job boundary.
+        if (status != 0) {
+            fprintf(stderr, "%s: exited with status %d.\n", queue->paths[index], status);
+            atomic_fetch_add_explicit(&queue->failed, 1, memory_order_relaxed);
+            auto worst = atomic_load_explicit(&queue->worst_status, memory_order_relaxed);
+            while (status > worst
+                   and not atomic_compare_exchange_weak_explicit(
+                       &queue->worst_status,
+                       &worst,
+                       status,
+                       memory_order_relaxed,
+                       memory_order_relaxed
+                   )) {
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Splits the manifest into one path per line in place, skipping blank lines,
+// and returns a malloc'd array of pointers into it.
+[[nodiscard]] static char const** collect_jobs(char* const manifest, int* const out_count) {
+    auto capacity = 64;
+    auto count = 0;
+    auto paths = (char const**)malloc(sizeof(char const*) * (size_t)capacity);
+    if (paths == nullptr) {
+        fprintf(stderr, "Not enough memory to read the manifest.\n");
+        exit(74);
+    }
+    for (auto cursor = manifest; *cursor != '\0';) {
+        auto const line = cursor;
+        while (*cursor != '\0' and *cursor != '\n') {
+            ++cursor;
+        }
+        auto const length = cursor - line;
+        if (*cursor == '\n') {
+            *cursor++ = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            auto const grown = (char const**)realloc(paths, sizeof(char const*) * (size_t)capacity);
+            if (grown == nullptr) {
+                fprintf(stderr, "Not enough memory to read the manifest.\n");
+                exit(74);
+            }
+            paths = grown;
+        }
+        paths[count++] = line;
+    }
+    *out_count = count;
+    return paths;
+}
+
+// Batch mode: runs every script listed in the manifest (one path per line)
+// across a pool of worker threads and exits with the worst status any script
+// produced. Identical scripts share compilation through the bytecode cache:
+// the first worker to compile one writes its .loxb file — built in a
+// temporary and renamed into place, so readers never see a torn cache — and
+// everyone else loads it.
+[[noreturn]] static void run_batch(char const* const manifest_path, int thread_count) {
+    auto const manifest = read_file(manifest_path);
+    if (manifest == nullptr) {
+        exit(74);
+    }
+    int job_count;
+    auto const paths = collect_jobs(manifest, &job_count);
+    if (job_count == 0) {
+        exit(0);
+    }
+
+    if (thread_count <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (thread_count <= 0) {
+            thread_count = 4;
+        }
+    }
+    if (thread_count > job_count) {
+        thread_count = job_count;
+    }
+
+    BatchQueue queue = {
+        .paths = paths,
+        .count = job_count,
+        .next = 0,
+        .failed = 0,
+        .worst_status = 0,
+    };
+    auto const workers = (thrd_t*)malloc(sizeof(thrd_t) * (size_t)thread_count);
+    if (workers == nullptr) {
+        fprintf(stderr, "Not enough memory to start %d workers.\n", thread_count);
+        exit(74);
+    }
+    auto started = 0;
+    for (; started < thread_count; ++started) {
+        if (thrd_create(&workers[started], batch_worker, &queue) != thrd_success) {
+            break;  // Run with the workers we got; one is enough to drain the queue.
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "Could not start any worker threads.\n");
+        exit(74);
+    }
+    for (auto i = 0; i < started; ++i) {
+        thrd_join(workers[i], nullptr);
+    }
+
+    auto const failed = atomic_load(&queue.failed);
+    if (failed != 0) {
+        fprintf(stderr, "%d of %d scripts failed.\n", failed, job_count);
+    }
+    auto const status = atomic_load(&queue.worst_status);
+    free(workers);
+    free(paths);
+    free(manifest);
+    exit(status);
+}
+
+#endif
+
+#ifdef CLOX_UNIX_SOCKETS
+
+// Reads from the descriptor until EOF into a NUL-terminated malloc'd buffer,
+// or nullptr on error.
+[[nodiscard]] static char* read_all_from_fd(int const fd) {
+    auto capacity = (size_t)4096;
+    auto length = (size_t)0;
+    auto buffer = (char*)malloc(capacity);
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+    for (;;) {
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            auto const grown = (char*)realloc(buffer, capacity);
+            if (grown == nullptr) {
+                free(buffer);
+                return nullptr;
+            }
+            buffer = grown;
+        }
+        auto const bytes_read = read(fd, buffer + length, capacity - length - 1);
+        if (bytes_read < 0) {
+            free(buffer);
+            return nullptr;
+        }
+        if (bytes_read == 0) {
+            buffer[length] = '\0';
+            return buffer;
+        }
+        length += (size_t)bytes_read;
+    }
+}
+
+// Runs one submitted script on the warm VM, streaming its output to the
+// client and finishing with a status trailer line ("0", "65", or "70",
+// matching the exit codes run_file() would use). Compiled scripts are cached
+// in a global slot keyed by their source hash — the name can't collide with
+// an identifier, and globals are GC roots, so the functions survive
+// collections between requests.
+static void run_request(VM* const vm, int const client_fd, char const* const source) {
+    auto const source_hash = hash_string(source, (int)strlen(source));
+    char cache_name[32];
+    auto const cache_name_length =
+        snprintf(cache_name, sizeof(cache_name), "<script %016llx>", (unsigned long long)source_hash);
+    auto const slot = resolve_global_slot(vm, copy_string(vm, cache_name, cache_name_length));
+
+    ObjFunction const* function;
+    if (IS_UNDEFINED(vm->global_values.values[slot])) {
+        function = compile(vm, source);
+        if (function == nullptr) {
+            dprintf(client_fd, "65\n");
+            return;
+        }
+        vm->global_values.values[slot] = OBJ_VAL(function);
+    } else {
+        function = AS_FUNCTION(vm->global_values.values[slot]);
+    }
+
+    // The interpreter prints through stdout; point it at the client for the
+    // duration of the request.
+    print_flush();
+    fflush(stdout);
+    auto const saved_stdout = dup(STDOUT_FILENO);
+    dup2(client_fd, STDOUT_FILENO);
+    auto const result = interpret_compiled(vm, function);
+    print_flush();
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    dprintf(client_fd, "%d\n", result == INTERPRET_OK ? 0 : 70);
+}
 
-    if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
+// Daemon mode: accepts scripts over a Unix domain socket (one script per
+// connection, terminated by the client shutting down its write side) and
+// runs each on the same warm VM, so natives, interned strings, and compiled
+// functions are shared across requests instead of being rebuilt per process.
+static void serve(VM* const vm, char const* const socket_path) {
+    signal(SIGPIPE, SIG_IGN);  // A disconnecting client must not kill us.
+
+    struct sockaddr_un address = { 0 };
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", socket_path);
+        exit(74);
+    }
+    strcpy(address.sun_path, socket_path);
+
+    auto const listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    (void)unlink(socket_path);  // Remove a stale socket from a previous run.
+    if (listen_fd == -1 or bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        or listen(listen_fd, 8) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\".\n", socket_path);
+        exit(74);
+    }
+
+    for (;;) {
+        auto const client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd == -1) {
+            continue;
+        }
+        auto const source = read_all_from_fd(client_fd);
+        if (source != nullptr) {
+            run_request(vm, client_fd, source);
+            free(source);
+        }
+        close(client_fd);
+    }
 }
 
+#endif
+
 int main(int const argc, char const* const* const argv) {
-    init_vm();
+    static VM vm;
+    init_vm(&vm);
 
     switch (argc) {
         case 1:
-            repl();
+            repl(&vm);
             break;
         case 2:
-            run_file(argv[1]);
+            run_file(&vm, argv[1]);
             break;
+        case 3:
+#ifdef CLOX_UNIX_SOCKETS
+            if (strcmp(argv[1], "--serve") == 0) {
+                serve(&vm, argv[2]);
+            }
+#endif
+#ifdef CLOX_THREADS
+            if (strcmp(argv[1], "--batch") == 0) {
+                run_batch(argv[2], 0);  // 0: one worker per core.
+            }
+#endif
+            [[fallthrough]];
+        case 4:
+#ifdef CLOX_THREADS
+            if (argc == 4 and strcmp(argv[1], "--batch") == 0) {
+                run_batch(argv[2], atoi(argv[3]));
+            }
+#endif
+            if (argc == 4 and strcmp(argv[1], "--restore") == 0) {
+                // Warm start: the snapshot replays the globals of an earlier
+                // setup run before the script itself executes.
+                if (not loxb_read_snapshot(&vm, argv[2])) {
+                    fprintf(stderr, "Could not restore snapshot \"%s\".\n", argv[2]);
+                    exit(74);
+                }
+                run_file(&vm, argv[3]);
+                break;
+            }
+            [[fallthrough]];
         default:
-            fprintf(stderr, "Usage: clox [path]\n");
+            fprintf(
+                stderr,
+                "Usage: clox [path | --serve <socket> | --restore <snapshot> <path> | --batch <manifest> [threads]]\n"
+            );
             exit(64);
             break;
     }
 
-    free_vm();
+    free_vm(&vm);
 }
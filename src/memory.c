@@ -1,8 +1,147 @@
 #include "memory.h"
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include "compiler.h"
 #include "vm.h"
 
-void* reallocate(void* const pointer, size_t, size_t const new_size) {
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+#define POOL_SLAB_SIZE (16 * 1024)
+
+static size_t const pool_block_sizes[POOL_SIZE_CLASS_COUNT] = { 32, 48, 64, 128 };
+
+void init_pools(VM* const vm) {
+    for (auto i = 0; i < POOL_SIZE_CLASS_COUNT; ++i) {
+        auto const pool = &vm->pools[i];
+        pool->block_size = pool_block_sizes[i];
+        pool->free_list = nullptr;
+        pool->slabs = nullptr;
+        pool->bump = nullptr;
+        pool->bump_end = nullptr;
+    }
+}
+
+[[nodiscard]] static ObjectPool* pool_for_size(VM* const vm, size_t const size) {
+    for (auto i = 0; i < POOL_SIZE_CLASS_COUNT; ++i) {
+        if (size <= pool_block_sizes[i]) {
+            return &vm->pools[i];
+        }
+    }
+    return nullptr;
+}
+
+// Aborts the running script when a collection could not bring usage back
+// under the configured limit. Outside of a running script (during startup or
+// compilation) there is no handler to unwind to, so exhaustion stays fatal.
+[[noreturn]] static void out_of_memory(VM* const vm) {
+    if (vm->oom_handler != nullptr) {
+        longjmp(*vm->oom_handler, 1);
+    }
+    fprintf(stderr, "Out of memory: limit of %zu bytes exceeded.\n", vm->memory_limit);
+    exit(EXIT_FAILURE);
+}
+
+static void account_allocation(VM* const vm, size_t const size) {
+    // The ceiling is checked before the counter moves, so a rejected
+    // allocation leaves the accounting intact.
+    if (vm->bytes_allocated + size > vm->memory_limit) {
+        collect_garbage(vm);
+        if (vm->bytes_allocated + size > vm->memory_limit) {
+            out_of_memory(vm);
+        }
+    }
+
+    vm->bytes_allocated += size;
+    if (vm->bytes_allocated > vm->peak_allocated) {
+        vm->peak_allocated = vm->bytes_allocated;
+    }
+
+#ifdef CLOX_STRESS_GC
+    collect_garbage(vm);
+#else
+    if (vm->bytes_allocated > vm->next_gc) {
+        collect_garbage(vm);
+    }
+#endif
+}
+
+void* pool_allocate(VM* const vm, size_t const size) {
+    auto const pool = pool_for_size(vm, size);
+    if (pool == nullptr) {
+        // Too big for any size class; fall through to the system allocator.
+        return reallocate(vm, nullptr, 0, size);
+    }
+
+    // A collection may run here, which can push freed blocks onto the free
+    // list we pop from below.
+    account_allocation(vm, size);
+
+    if (pool->free_list != nullptr) {
+        auto const block = pool->free_list;
+        pool->free_list = block->next;
+        return block;
+    }
+
+    if (pool->bump + pool->block_size > pool->bump_end) {
+        // Slabs are deliberately invisible to the GC accounting; each block
+        // is accounted for individually when it is handed out.
+        auto const slab = (PoolSlab*)malloc(POOL_SLAB_SIZE);
+        if (slab == nullptr) {
+            exit(EXIT_FAILURE);
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->bump = (char*)slab + pool->block_size;
+        pool->bump_end = (char*)slab + POOL_SLAB_SIZE;
+    }
+
+    auto const block = pool->bump;
+    pool->bump += pool->block_size;
+    return block;
+}
+
+void pool_free(VM* const vm, void* const pointer, size_t const size) {
+    auto const pool = pool_for_size(vm, size);
+    if (pool == nullptr) {
+        reallocate(vm, pointer, size, 0);
+        return;
+    }
+
+    vm->bytes_allocated -= size;
+
+    auto const block = (PoolFreeBlock*)pointer;
+    block->next = pool->free_list;
+    pool->free_list = block;
+}
+
+static void free_pools(VM* const vm) {
+    for (auto i = 0; i < POOL_SIZE_CLASS_COUNT; ++i) {
+        auto const pool = &vm->pools[i];
+        auto slab = pool->slabs;
+        while (slab != nullptr) {
+            auto const next = slab->next;
+            free(slab);
+            slab = next;
+        }
+        pool->slabs = nullptr;
+        pool->free_list = nullptr;
+        pool->bump = nullptr;
+        pool->bump_end = nullptr;
+    }
+}
+
+void* reallocate(VM* const vm, void* const pointer, size_t const old_size, size_t const new_size) {
+    if (new_size > old_size) {
+        // Only the delta is fresh; accounting it keeps the counter exact if
+        // the limit check in account_allocation() rejects the growth.
+        account_allocation(vm, new_size - old_size);
+    } else {
+        vm->bytes_allocated -= old_size - new_size;
+    }
+
     if (new_size == 0) {
         free(pointer);
         return nullptr;
@@ -15,37 +154,248 @@ void* reallocate(void* const pointer, size_t, size_t const new_size) {
     return result;
 }
 
-static void free_object(Obj* const object) {
+void mark_object(VM* const vm, Obj* const object) {
+    if (object == nullptr or object->is_marked) {
+        return;
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    print_value(OBJ_VAL(object));
+    print_flush();
+    printf("\n");
+#endif
+
+    object->is_marked = true;
+
+    if (vm->gray_capacity < vm->gray_count + 1) {
+        vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+        // The gray stack must not go through reallocate(), otherwise growing
+        // it could trigger a recursive collection.
+        vm->gray_stack = (Obj**)realloc(vm->gray_stack, sizeof(Obj*) * (size_t)vm->gray_capacity);
+        if (vm->gray_stack == nullptr) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    vm->gray_stack[vm->gray_count++] = object;
+}
+
+void mark_value(VM* const vm, Value const value) {
+    if (IS_OBJ(value)) {
+        mark_object(vm, AS_OBJ(value));
+    }
+}
+
+static void mark_array(VM* const vm, ValueArray const* const array) {
+    for (auto i = 0; i < array->count; ++i) {
+        mark_value(vm, array->values[i]);
+    }
+}
+
+static void blacken_object(VM* const vm, Obj* const object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    print_value(OBJ_VAL(object));
+    print_flush();
+    printf("\n");
+#endif
+
     switch (object->type) {
-        case OBJ_CLOSURE:
+        case OBJ_CLOSURE: {
             auto const closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, object);
+            mark_object(vm, (Obj*)closure->function);
+            for (auto i = 0; i < closure->upvalue_count; ++i) {
+                mark_object(vm, (Obj*)closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FIBER: {
+            auto const fiber = (ObjFiber*)object;
+            mark_object(vm, (Obj*)fiber->closure);
+            mark_object(vm, (Obj*)fiber->caller);
+            // A suspended fiber owns its saved context; a running one has
+            // handed it to the VM, where mark_roots() covers it and these
+            // loops see empty arrays.
+            for (auto slot = fiber->stack; slot < fiber->stack_top; ++slot) {
+                mark_value(vm, *slot);
+            }
+            for (auto i = 0; i < fiber->frame_count; ++i) {
+                mark_object(vm, (Obj*)fiber->frames[i].closure);
+            }
+            for (auto i = 0; i < fiber->open_upvalue_count; ++i) {
+                mark_object(vm, (Obj*)fiber->open_upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            auto const function = (ObjFunction*)object;
+            mark_object(vm, (Obj*)function->name);
+            mark_array(vm, &function->chunk.constants);
+            break;
+        }
+        case OBJ_LIST:
+            mark_array(vm, &((ObjList*)object)->items);
+            break;
+        case OBJ_MAP:
+            mark_table(vm, &((ObjMap*)object)->table);
+            break;
+        case OBJ_UPVALUE:
+            mark_value(vm, ((ObjUpvalue*)object)->closed);
             break;
+        case OBJ_NATIVE:
         case OBJ_STRING:
-            FREE(ObjString, object);
+        case OBJ_STRING_BUILDER:
+            break;
+    }
+}
+
+static void free_object(VM* const vm, Obj* const object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
+    --vm->object_counts[object->type];
+
+    switch (object->type) {
+        case OBJ_CLOSURE:
+            auto const closure = (ObjClosure*)object;
+            FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalue_count);
+            pool_free(vm, object, sizeof(ObjClosure));
+            break;
+        case OBJ_STRING: {
+            // Strings carry their characters in a flexible array member, so
+            // the true allocation size depends on the length.
+            auto const string = (ObjString*)object;
+            pool_free(vm, object, sizeof(ObjString) + (size_t)string->length + 1);
+            break;
+        }
+        case OBJ_STRING_BUILDER: {
+            auto const builder = (ObjStringBuilder*)object;
+            FREE_ARRAY(vm, char, builder->chars, builder->capacity);
+            pool_free(vm, object, sizeof(ObjStringBuilder));
+            break;
+        }
+        case OBJ_LIST: {
+            auto const list = (ObjList*)object;
+            free_value_array(vm, &list->items);
+            pool_free(vm, object, sizeof(ObjList));
             break;
+        }
+        case OBJ_MAP: {
+            auto const map = (ObjMap*)object;
+            free_table(vm, &map->table);
+            pool_free(vm, object, sizeof(ObjMap));
+            break;
+        }
+        case OBJ_FIBER: {
+            // The context arrays are raw allocations (see resume_native() in
+            // vm.c), so they are freed directly rather than through the
+            // collector's bookkeeping.
+            auto const fiber = (ObjFiber*)object;
+            free(fiber->frames);
+            free(fiber->stack);
+            free(fiber->open_upvalues);
+            pool_free(vm, object, sizeof(ObjFiber));
+            break;
+        }
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            pool_free(vm, object, sizeof(ObjUpvalue));
             break;
         case OBJ_FUNCTION: {
             auto const function = (ObjFunction*)object;
-            free_chunk(&function->chunk);
-            FREE(ObjFunction, object);
+            free_chunk(vm, &function->chunk);
+            pool_free(vm, object, sizeof(ObjFunction));
             break;
         }
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            pool_free(vm, object, sizeof(ObjNative));
             break;
         }
     }
 }
 
-void free_objects() {
-    auto object = vm.objects;
+static void mark_roots(VM* const vm) {
+    for (auto slot = vm->stack; slot < vm->stack_top; ++slot) {
+        mark_value(vm, *slot);
+    }
+
+    for (auto i = 0; i < vm->frame_count; ++i) {
+        mark_object(vm, (Obj*)vm->frames[i].closure);
+    }
+
+    for (auto i = 0; i < vm->open_upvalue_count; ++i) {
+        mark_object(vm, (Obj*)vm->open_upvalues[i]);
+    }
+
+    // The whole resume chain is reachable through the caller links.
+    mark_object(vm, (Obj*)vm->current_fiber);
+
+    mark_table(vm, &vm->global_names);
+    mark_array(vm, &vm->global_values);
+    mark_compiler_roots(vm);
+}
+
+static void trace_references(VM* const vm) {
+    while (vm->gray_count > 0) {
+        auto const object = vm->gray_stack[--vm->gray_count];
+        blacken_object(vm, object);
+    }
+}
+
+static void sweep(VM* const vm) {
+    auto previous = (Obj*)nullptr;
+    auto object = vm->objects;
+    while (object != nullptr) {
+        if (object->is_marked) {
+            object->is_marked = false;
+            previous = object;
+            object = object->next;
+        } else {
+            auto const unreached = object;
+            object = object->next;
+            (previous == nullptr ? vm->objects : previous->next) = object;
+            free_object(vm, unreached);
+        }
+    }
+}
+
+void collect_garbage(VM* const vm) {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    auto const before = vm->bytes_allocated;
+#endif
+
+    mark_roots(vm);
+    trace_references(vm);
+    // Interned strings are weak references: drop the ones nothing else kept
+    // alive, right before the sweep frees them.
+    table_remove_white(&vm->strings);
+    sweep(vm);
+
+    vm->next_gc = (size_t)((double)vm->bytes_allocated * vm->heap_grow_factor);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf(
+        "   collected %zu bytes (from %zu to %zu), next at %zu\n",
+        before - vm->bytes_allocated,
+        before,
+        vm->bytes_allocated,
+        vm->next_gc
+    );
+#endif
+}
+
+void free_objects(VM* const vm) {
+    auto object = vm->objects;
     while (object != nullptr) {
         auto const next = object->next;
-        free_object(object);
+        free_object(vm, object);
         object = next;
     }
+
+    free_pools(vm);
+    free(vm->gray_stack);
+    vm->gray_stack = nullptr;
 }
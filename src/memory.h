@@ -3,16 +3,50 @@
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count) (type*)reallocate(nullptr, 0, sizeof(type) * (size_t)(count))
+#define ALLOCATE(vm, type, count) (type*)reallocate(vm, nullptr, 0, sizeof(type) * (size_t)(count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, old_count, new_count) \
-    (type*)reallocate(pointer, sizeof(type) * (size_t)(old_count), sizeof(type) * (size_t)(new_count))
+#define GROW_ARRAY(vm, type, pointer, old_count, new_count) \
+    (type*)reallocate(vm, pointer, sizeof(type) * (size_t)(old_count), sizeof(type) * (size_t)(new_count))
 
-#define FREE_ARRAY(type, pointer, old_count) reallocate(pointer, sizeof(type) * (size_t)(old_count), 0)
+#define FREE_ARRAY(vm, type, pointer, old_count) reallocate(vm, pointer, sizeof(type) * (size_t)(old_count), 0)
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size);
-void free_objects();
+// Default factor by which the collection threshold grows after each GC cycle.
+// The actual factor lives in the VM and can be tuned at runtime.
+#define GC_HEAP_GROW_FACTOR 2.0
+
+// Small VM objects (upvalues, closures, short strings, ...) are carved out of
+// size-classed pools instead of hitting the system allocator. Each pool bump-
+// allocates blocks from multi-kilobyte slabs and recycles freed blocks
+// through a free list, so allocation is a pointer pop in the common case and
+// objects of the same kind end up close together in memory.
+#define POOL_SIZE_CLASS_COUNT 4
+
+typedef struct PoolFreeBlock {
+    struct PoolFreeBlock* next;
+} PoolFreeBlock;
+
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct {
+    size_t block_size;
+    PoolFreeBlock* free_list;
+    PoolSlab* slabs;
+    char* bump;
+    char* bump_end;
+} ObjectPool;
+
+void init_pools(VM* vm);
+void* pool_allocate(VM* vm, size_t size);
+void pool_free(VM* vm, void* pointer, size_t size);
+
+void* reallocate(VM* vm, void* pointer, size_t old_size, size_t new_size);
+void mark_object(VM* vm, Obj* object);
+void mark_value(VM* vm, Value value);
+void collect_garbage(VM* vm);
+void free_objects(VM* vm);
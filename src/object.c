@@ -6,97 +6,198 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, object_type) (type*)allocate_object(sizeof(type), object_type)
+#define ALLOCATE_OBJ(vm, type, object_type) (type*)allocate_object(vm, sizeof(type), object_type)
 
-static Obj* allocate_object(size_t const size, ObjType const type) {
-    auto const object = (Obj*)reallocate(nullptr, 0, size);
+static Obj* allocate_object(VM* const vm, size_t const size, ObjType const type) {
+    auto const object = (Obj*)pool_allocate(vm, size);
     object->type = type;
+    object->is_marked = false;
+
+    object->next = vm->objects;
+    vm->objects = object;
+    ++vm->object_counts[type];
+
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*)object, size, type);
+#endif
 
-    object->next = vm.objects;
-    vm.objects = object;
     return object;
 }
 
-[[nodiscard]] ObjClosure* new_closure(ObjFunction const* const function) {
-    auto const upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
+[[nodiscard]] ObjClosure* new_closure(VM* const vm, ObjFunction const* const function) {
+    auto const upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalue_count);
     for (auto i = 0; i < function->upvalue_count; ++i) {
         upvalues[i] = nullptr;
     }
 
-    auto const closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    auto const closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
     return closure;
 }
 
-[[nodiscard]] ObjFunction* new_function() {
-    auto const function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+[[nodiscard]] ObjFiber* new_fiber(VM* const vm, ObjClosure const* const closure) {
+    auto const fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->closure = closure;
+    fiber->caller = nullptr;
+    fiber->state = FIBER_NEW;
+    // The context arrays are allocated on first resume (see resume_native()
+    // in vm.c), so that thousands of never-started fibers stay cheap.
+    fiber->frames = nullptr;
+    fiber->frame_count = 0;
+    fiber->frame_capacity = 0;
+    fiber->stack = nullptr;
+    fiber->stack_top = nullptr;
+    fiber->stack_capacity = 0;
+    fiber->open_upvalues = nullptr;
+    fiber->open_upvalue_count = 0;
+    fiber->open_upvalue_capacity = 0;
+    return fiber;
+}
+
+[[nodiscard]] ObjFunction* new_function(VM* const vm) {
+    auto const function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalue_count = 0;
+    function->profile_index = -1;
     function->name = nullptr;
     init_chunk(&function->chunk);
     return function;
 }
 
-[[nodiscard]] ObjNative* new_native(NativeFn const function) {
-    auto const native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+[[nodiscard]] ObjList* new_list(VM* const vm) {
+    auto const list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    init_value_array(&list->items);
+    return list;
+}
+
+[[nodiscard]] ObjMap* new_map(VM* const vm) {
+    auto const map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+    init_table(&map->table);
+    map->count = 0;
+    return map;
+}
+
+[[nodiscard]] ObjNative* new_native(VM* const vm, NativeFn const function) {
+    auto const native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-[[nodiscard]] uint32_t hash_string(char const* const chars, int const length) {
-    auto hash = 2166136261u;
-    for (auto i = 0; i < length; ++i) {
-        hash ^= (uint8_t)chars[i];
-        hash *= 16777619u;
+// Multiplies the two halves into a 128-bit product and folds it, the core
+// mixing step of wyhash-style hashes.
+[[nodiscard]] static uint64_t hash_mix(uint64_t const a, uint64_t const b) {
+#ifdef __SIZEOF_INT128__
+    auto const product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    // Without a 128-bit type, fold 32x64 partial products instead; weaker
+    // mixing, but only exotic toolchains take this path.
+    auto const low = (a & 0xFFFFFFFFull) * b;
+    auto const high = (a >> 32) * b;
+    return low ^ (high << 32) ^ (high >> 32);
+#endif
+}
+
+// wyhash-style block hash: 16 bytes per step through two folded 64-bit
+// multiplies, with the zero-padded tail handled in one final step. Replaces
+// byte-at-a-time FNV-1a, which dominated the string-churn profile.
+[[nodiscard]] uint64_t hash_string(char const* const chars, int const length) {
+    auto current = (uint8_t const*)chars;
+    auto remaining = (size_t)length;
+    auto seed = 0xA0761D6478BD642Full ^ (uint64_t)length;
+
+    while (remaining >= 16) {
+        uint64_t a;
+        uint64_t b;
+        memcpy(&a, current, sizeof(a));
+        memcpy(&b, current + 8, sizeof(b));
+        seed = hash_mix(a ^ seed, b ^ 0xE7037ED1A0B428DBull);
+        current += 16;
+        remaining -= 16;
     }
-    return hash;
+
+    uint8_t tail[16] = { 0 };
+    memcpy(tail, current, remaining);
+    uint64_t a;
+    uint64_t b;
+    memcpy(&a, tail, sizeof(a));
+    memcpy(&b, tail + 8, sizeof(b));
+    return hash_mix(a ^ seed, b ^ 0xE7037ED1A0B428DBull);
 }
 
-[[nodiscard]] ObjString* reserve_string(int const length, uint32_t const hash) {
-    auto const string_obj = (ObjString*)reallocate(nullptr, 0, sizeof(ObjString) + (size_t)length + 1);
+[[nodiscard]] ObjString* reserve_string(VM* const vm, int const length, uint64_t const hash) {
+    auto const string_obj = (ObjString*)pool_allocate(vm, sizeof(ObjString) + (size_t)length + 1);
     string_obj->obj.type = OBJ_STRING;
-    string_obj->obj.next = vm.objects;
-    vm.objects = (Obj*)string_obj;
+    string_obj->obj.is_marked = false;
+    string_obj->obj.next = vm->objects;
+    vm->objects = (Obj*)string_obj;
+    ++vm->object_counts[OBJ_STRING];
     string_obj->chars[length] = '\0';
     string_obj->length = length;
     string_obj->hash = hash;
     return string_obj;
 }
 
-[[nodiscard]] ObjString const* copy_string(char const* const chars, int const length) {
+[[nodiscard]] ObjString const* copy_string(VM* const vm, char const* const chars, int const length) {
     auto const hash = hash_string(chars, length);
 
     // Check if an equal string already has been interned.
-    auto const interned = table_find_string(&vm.strings, chars, length, hash);
+    auto const interned = table_find_string(&vm->strings, chars, length, hash);
     if (interned != nullptr) {
         return interned;
     }
 
-    auto const string_obj = reserve_string(length, hash);
+    auto const string_obj = reserve_string(vm, length, hash);
     memcpy(string_obj->chars, chars, (size_t)length);
 
-    // Intern string.
-    table_set(&vm.strings, string_obj, NIL_VAL);
+    // Intern string. Growing the intern table can trigger a collection, so
+    // the fresh string has to be reachable while it happens.
+    push(vm, OBJ_VAL(string_obj));
+    table_set(vm, &vm->strings, OBJ_VAL(string_obj), NIL_VAL);
+    (void)pop(vm);
 
     return string_obj;
 }
 
-[[nodiscard]] ObjUpvalue* new_upvalue(Value* const slot) {
-    auto const upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+[[nodiscard]] ObjStringBuilder* new_string_builder(VM* const vm) {
+    auto const builder = ALLOCATE_OBJ(vm, ObjStringBuilder, OBJ_STRING_BUILDER);
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->chars = nullptr;
+    return builder;
+}
+
+void string_builder_append(VM* const vm, ObjStringBuilder* const builder, char const* const chars, int const length) {
+    if (builder->capacity < builder->length + length) {
+        auto const old_capacity = builder->capacity;
+        auto new_capacity = GROW_CAPACITY(old_capacity);
+        while (new_capacity < builder->length + length) {
+            new_capacity = GROW_CAPACITY(new_capacity);
+        }
+        builder->chars = GROW_ARRAY(vm, char, builder->chars, old_capacity, new_capacity);
+        builder->capacity = new_capacity;
+    }
+    memcpy(builder->chars + builder->length, chars, (size_t)length);
+    builder->length += length;
+}
+
+[[nodiscard]] ObjUpvalue* new_upvalue(VM* const vm, Value* const slot) {
+    auto const upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
-    upvalue->next = nullptr;
     return upvalue;
 }
 
 static void print_function(ObjFunction const* const function) {
     if (function->name == nullptr) {
-        printf("<script>");
+        print_text("<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    print_text("<fn ");
+    print_chars(function->name->chars, function->name->length);
+    print_text(">");
 }
 
 void print_object(Value const value) {
@@ -104,17 +205,61 @@ void print_object(Value const value) {
         case OBJ_CLOSURE:
             print_function(AS_CLOSURE(value)->function);
             break;
-        case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+        case OBJ_FIBER:
+            print_text("<fiber>");
+            break;
+        case OBJ_STRING: {
+            auto const string = AS_STRING(value);
+            print_chars(string->chars, string->length);
+            break;
+        }
+        case OBJ_STRING_BUILDER: {
+            auto const builder = AS_STRING_BUILDER(value);
+            if (builder->chars != nullptr) {
+                print_chars(builder->chars, builder->length);
+            }
+            break;
+        }
+        case OBJ_LIST: {
+            auto const list = AS_LIST(value);
+            print_text("[");
+            for (auto i = 0; i < list->items.count; ++i) {
+                if (i > 0) {
+                    print_text(", ");
+                }
+                print_value(list->items.values[i]);
+            }
+            print_text("]");
+            break;
+        }
+        case OBJ_MAP: {
+            auto const map = AS_MAP(value);
+            print_text("{");
+            auto first = true;
+            for (auto i = 0; i < map->table.capacity; ++i) {
+                auto const entry = &map->table.entries[i];
+                if (IS_UNDEFINED(entry->key)) {
+                    continue;
+                }
+                if (not first) {
+                    print_text(", ");
+                }
+                first = false;
+                print_value(entry->key);
+                print_text(": ");
+                print_value(entry->value);
+            }
+            print_text("}");
             break;
+        }
         case OBJ_UPVALUE:
-            printf("upvalue");
+            print_text("upvalue");
             break;
         case OBJ_FUNCTION:
             print_function(AS_FUNCTION(value));
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            print_text("<native fn>");
             break;
     }
 }
@@ -2,31 +2,48 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_CLOSURE(value) is_obj_type(value, OBJ_CLOSURE)
+#define IS_FIBER(value) is_obj_type(value, OBJ_FIBER)
 #define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
+#define IS_LIST(value) is_obj_type(value, OBJ_LIST)
+#define IS_MAP(value) is_obj_type(value, OBJ_MAP)
 #define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
+#define IS_STRING_BUILDER(value) is_obj_type(value, OBJ_STRING_BUILDER)
 
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
 
 typedef enum {
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
+    OBJ_LIST,
+    OBJ_MAP,
     OBJ_NATIVE,
     OBJ_STRING,
+    OBJ_STRING_BUILDER,
     OBJ_UPVALUE,
 } ObjType;
 
+// Not an enumerator, so switches over ObjType stay exhaustive.
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
 struct Obj {
     ObjType type;
+    bool is_marked;
     struct Obj* next;
 };
 
@@ -34,11 +51,14 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalue_count;
+    // Index into the profiler's record array, or -1 before the first profiled
+    // call (see profiler.h).
+    int profile_index;
     Chunk chunk;
     ObjString const* name;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int arg_count, Value* args);
+typedef Value (*NativeFn)(VM* vm, int arg_count, Value* args);
 
 typedef struct {
     Obj obj;
@@ -48,15 +68,41 @@ typedef struct {
 struct ObjString {
     Obj obj;
     int length;
-    uint32_t hash;
+    uint64_t hash;
     char chars[];
 };
 
-typedef struct ObjUpvalue {
+// A mutable character buffer with amortized-doubling append, so that building
+// a string from many fragments is O(total length) instead of one interned
+// intermediate string per concatenation.
+typedef struct {
+    Obj obj;
+    int length;
+    int capacity;
+    char* chars;
+} ObjStringBuilder;
+
+// A dynamic array of values in one contiguous buffer, the aggregate type
+// scripts previously had to fake with chains of closures. Element storage
+// reuses the ValueArray machinery, so push is amortized O(1).
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+// A hash map from arbitrary keys to values, backed by the same Swiss-table
+// Table the VM uses internally. `count` tracks the live entries, since the
+// table's own count includes tombstones.
+typedef struct {
+    Obj obj;
+    Table table;
+    int count;
+} ObjMap;
+
+typedef struct {
     Obj obj;
     Value* location;
     Value closed;
-    struct ObjUpvalue* next;
 } ObjUpvalue;
 
 typedef struct {
@@ -66,13 +112,49 @@ typedef struct {
     int upvalue_count;
 } ObjClosure;
 
-[[nodiscard]] ObjClosure* new_closure(ObjFunction const* function);
-[[nodiscard]] ObjFunction* new_function();
-[[nodiscard]] ObjNative* new_native(NativeFn function);
-[[nodiscard]] uint32_t hash_string(char const* chars, int length);
-[[nodiscard]] ObjString* reserve_string(int length, uint32_t hash);
-[[nodiscard]] ObjString const* copy_string(char const* chars, int length);
-[[nodiscard]] ObjUpvalue* new_upvalue(Value* slot);
+typedef enum {
+    FIBER_NEW,  // created, never resumed
+    FIBER_RUNNING,  // the fiber the VM is currently executing
+    FIBER_WAITING,  // suspended inside resume(), waiting for its resumee
+    FIBER_SUSPENDED,  // suspended inside yield(), resumable
+    FIBER_DONE,  // ran to completion (or was torn down by an error)
+} FiberState;
+
+// Defined in vm.h; a fiber only ever stores frames, never inspects them.
+typedef struct CallFrame CallFrame;
+
+// A cooperative coroutine: a closure running on its own call-frame array and
+// value-stack segment. While a fiber is suspended it owns its context here;
+// while it runs, resume() hands the context to the corresponding VM fields
+// and clears these, so the arrays always have exactly one owner.
+typedef struct ObjFiber {
+    Obj obj;
+    ObjClosure const* closure;  // nullptr for the fiber wrapping the main script
+    struct ObjFiber* caller;  // who to wake on yield() or completion
+    FiberState state;
+    CallFrame* frames;
+    int frame_count;
+    int frame_capacity;
+    Value* stack;
+    Value* stack_top;
+    int stack_capacity;
+    ObjUpvalue** open_upvalues;
+    int open_upvalue_count;
+    int open_upvalue_capacity;
+} ObjFiber;
+
+[[nodiscard]] ObjClosure* new_closure(VM* vm, ObjFunction const* function);
+[[nodiscard]] ObjFiber* new_fiber(VM* vm, ObjClosure const* closure);
+[[nodiscard]] ObjFunction* new_function(VM* vm);
+[[nodiscard]] ObjList* new_list(VM* vm);
+[[nodiscard]] ObjMap* new_map(VM* vm);
+[[nodiscard]] ObjNative* new_native(VM* vm, NativeFn function);
+[[nodiscard]] uint64_t hash_string(char const* chars, int length);
+[[nodiscard]] ObjString* reserve_string(VM* vm, int length, uint64_t hash);
+[[nodiscard]] ObjString const* copy_string(VM* vm, char const* chars, int length);
+[[nodiscard]] ObjUpvalue* new_upvalue(VM* vm, Value* slot);
+[[nodiscard]] ObjStringBuilder* new_string_builder(VM* vm);
+void string_builder_append(VM* vm, ObjStringBuilder* builder, char const* chars, int length);
 void print_object(Value value);
 
 static inline bool is_obj_type(Value const value, ObjType const type) {
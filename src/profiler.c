@@ -0,0 +1,138 @@
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chunk.h"
+
+thread_local Profiler profiler;
+
+[[nodiscard]] static uint64_t monotonic_nanoseconds() {
+    struct timespec timestamp;
+    clock_gettime(CLOCK_MONOTONIC, &timestamp);
+    return (uint64_t)timestamp.tv_sec * 1000000000ull + (uint64_t)timestamp.tv_nsec;
+}
+
+void init_profiler() {
+    memset(&profiler, 0, sizeof(profiler));
+}
+
+void free_profiler() {
+    for (auto i = 0; i < profiler.function_count; ++i) {
+        free(profiler.functions[i].name);
+    }
+    free(profiler.functions);
+    free(profiler.frame_start);
+    memset(&profiler, 0, sizeof(profiler));
+}
+
+[[nodiscard]] static int register_function(ObjFunction const* const function) {
+    if (profiler.function_count == profiler.function_capacity) {
+        profiler.function_capacity = profiler.function_capacity < 8 ? 8 : profiler.function_capacity * 2;
+        // Raw realloc: profiler bookkeeping is not part of the garbage
+        // collected heap and must never trigger a collection.
+        profiler.functions =
+            (FunctionProfile*)realloc(profiler.functions, sizeof(FunctionProfile) * (size_t)profiler.function_capacity);
+        if (profiler.functions == nullptr) {
+            exit(1);
+        }
+    }
+
+    auto const index = profiler.function_count++;
+    auto const record = &profiler.functions[index];
+    record->name = strdup(function->name == nullptr ? "<script>" : function->name->chars);
+    record->invocations = 0;
+    record->inclusive_nanoseconds = 0;
+    return index;
+}
+
+void profiler_record_call(ObjFunction const* const function, int const frame_index) {
+    if (function->profile_index < 0) {
+        // The index is cached in the function object itself so that the hot
+        // path below is a single array access (cast like mark_table() does).
+        ((ObjFunction*)function)->profile_index = register_function(function);
+    }
+    ++profiler.functions[function->profile_index].invocations;
+    if (frame_index >= profiler.frame_start_capacity) {
+        auto new_capacity = profiler.frame_start_capacity < 64 ? 64 : profiler.frame_start_capacity * 2;
+        while (new_capacity <= frame_index) {
+            new_capacity *= 2;
+        }
+        profiler.frame_start = (uint64_t*)realloc(profiler.frame_start, sizeof(uint64_t) * (size_t)new_capacity);
+        if (profiler.frame_start == nullptr) {
+            exit(1);
+        }
+        // Fresh entries start out zeroed, i.e. "entered while disabled".
+        memset(
+            profiler.frame_start + profiler.frame_start_capacity,
+            0,
+            sizeof(uint64_t) * (size_t)(new_capacity - profiler.frame_start_capacity)
+        );
+        profiler.frame_start_capacity = new_capacity;
+    }
+    profiler.frame_start[frame_index] = monotonic_nanoseconds();
+}
+
+void profiler_record_return(ObjFunction const* const function, int const frame_index) {
+    if (function->profile_index < 0 or frame_index >= profiler.frame_start_capacity
+        or profiler.frame_start[frame_index] == 0) {
+        return;
+    }
+    profiler.functions[function->profile_index].inclusive_nanoseconds +=
+        monotonic_nanoseconds() - profiler.frame_start[frame_index];
+    profiler.frame_start[frame_index] = 0;
+}
+
+[[nodiscard]] static int compare_function_profiles(void const* const lhs, void const* const rhs) {
+    auto const a = (FunctionProfile const*)lhs;
+    auto const b = (FunctionProfile const*)rhs;
+    if (a->inclusive_nanoseconds != b->inclusive_nanoseconds) {
+        return a->inclusive_nanoseconds < b->inclusive_nanoseconds ? 1 : -1;
+    }
+    return a->invocations < b->invocations ? 1 : (a->invocations > b->invocations ? -1 : 0);
+}
+
+[[nodiscard]] static int compare_opcode_counts(void const* const lhs, void const* const rhs) {
+    auto const a = profiler.opcode_counts[*(uint8_t const*)lhs];
+    auto const b = profiler.opcode_counts[*(uint8_t const*)rhs];
+    return a < b ? 1 : (a > b ? -1 : 0);
+}
+
+void profiler_dump() {
+    auto total_opcodes = (uint64_t)0;
+    for (auto i = 0; i < UINT8_COUNT; ++i) {
+        total_opcodes += profiler.opcode_counts[i];
+    }
+    if (total_opcodes == 0 and profiler.function_count == 0) {
+        return;
+    }
+
+    fprintf(stderr, "== profile ==\n");
+
+    fprintf(stderr, "functions (by inclusive time):\n");
+    qsort(profiler.functions, (size_t)profiler.function_count, sizeof(FunctionProfile), compare_function_profiles);
+    for (auto i = 0; i < profiler.function_count; ++i) {
+        auto const record = &profiler.functions[i];
+        fprintf(
+            stderr,
+            "%14llu ns %10llu calls  %s\n",
+            (unsigned long long)record->inclusive_nanoseconds,
+            (unsigned long long)record->invocations,
+            record->name
+        );
+    }
+
+    fprintf(stderr, "opcodes (by count, %llu total):\n", (unsigned long long)total_opcodes);
+    uint8_t opcodes[UINT8_COUNT];
+    for (auto i = 0; i < UINT8_COUNT; ++i) {
+        opcodes[i] = (uint8_t)i;
+    }
+    qsort(opcodes, UINT8_COUNT, sizeof(uint8_t), compare_opcode_counts);
+    for (auto i = 0; i < UINT8_COUNT; ++i) {
+        auto const count = profiler.opcode_counts[opcodes[i]];
+        if (count == 0) {
+            break;
+        }
+        fprintf(stderr, "%14llu  %s\n", (unsigned long long)count, opcode_name(opcodes[i]));
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+// Always-compiled, runtime-togglable profiling. While enabled (via the
+// profile() native), the VM counts every executed opcode and records per-
+// function invocation counts plus inclusive wall-clock time; free_vm() then
+// dumps a sorted hot-spot report to stderr. When disabled, the only cost is
+// one predictable branch per dispatch and per call/return.
+
+typedef struct {
+    char* name;  // Owned copy, so the record outlives the collected function.
+    uint64_t invocations;
+    uint64_t inclusive_nanoseconds;
+} FunctionProfile;
+
+typedef struct {
+    bool enabled;
+    uint64_t opcode_counts[UINT8_COUNT];
+    FunctionProfile* functions;
+    int function_count;
+    int function_capacity;
+    // Entry timestamp per call frame, indexed like the VM's frame array and
+    // grown alongside it. Zero marks a frame that was entered while profiling
+    // was disabled.
+    uint64_t* frame_start;
+    int frame_start_capacity;
+} Profiler;
+
+// Per-thread, matching the one-VM-per-worker-thread model; the report covers
+// the VMs the thread ran.
+extern thread_local Profiler profiler;
+
+void init_profiler();
+void free_profiler();
+void profiler_record_call(ObjFunction const* function, int frame_index);
+void profiler_record_return(ObjFunction const* function, int frame_index);
+void profiler_dump();
@@ -9,7 +9,8 @@ typedef struct {
     int line;
 } Scanner;
 
-Scanner scanner;
+// Per-thread, so worker threads can scan independent sources concurrently.
+static thread_local Scanner scanner;
 
 [[nodiscard]] static bool is_at_end() {
     return *scanner.current == '\0';
@@ -56,41 +57,287 @@ Scanner scanner;
     return scanner.current[1];
 }
 
-static void skip_whitespace() {
+[[nodiscard]] bool is_digit(char const c) {
+    return c >= '0' and c <= '9';
+}
+
+[[nodiscard]] static bool is_alpha(char const c) {
+    return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or c == '_';
+}
+
+// ==== Vectorized scanning kernels ============================================
+//
+// The hot scanner loops — identifier and digit runs, string literals, line
+// comments, and whitespace spans — classify 16 bytes at a time where SSE2 or
+// NEON is available. After a short scalar prefix, the kernels advance with
+// *aligned* 16-byte loads: an aligned load never crosses a page boundary, so
+// reading a few bytes past the terminating NUL of the source is safe, and NUL
+// itself never continues a run. Newlines are counted per block instead of per
+// character. On other targets the kernels compile to plain byte loops.
+
+#if defined(__SSE2__)
+#define CLOX_SIMD
+#include <emmintrin.h>
+
+typedef __m128i CharBlock;
+
+[[nodiscard]] static CharBlock block_load(char const* const aligned) {
+    return _mm_load_si128((__m128i const*)aligned);
+}
+
+[[nodiscard]] static CharBlock block_in_range(CharBlock const block, char const low, char const high) {
+    // Signed compares are fine here: bytes >= 0x80 come out negative and
+    // therefore outside every ASCII range, which correctly stops a run.
+    return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8(high + 1)));
+}
+
+[[nodiscard]] static CharBlock block_equal(CharBlock const block, char const c) {
+    return _mm_cmpeq_epi8(block, _mm_set1_epi8(c));
+}
+
+[[nodiscard]] static CharBlock block_or(CharBlock const a, CharBlock const b) {
+    return _mm_or_si128(a, b);
+}
+
+// Index of the first byte not covered by the mask, or 16 if all 16 are.
+[[nodiscard]] static int block_first_unset(CharBlock const mask) {
+    auto const unset = ~(uint32_t)_mm_movemask_epi8(mask) & 0xFFFFu;
+    return unset == 0 ? 16 : __builtin_ctz(unset);
+}
+
+// Index of the first byte covered by the mask, or 16 if none is.
+[[nodiscard]] static int block_first_set(CharBlock const mask) {
+    auto const set = (uint32_t)_mm_movemask_epi8(mask);
+    return set == 0 ? 16 : __builtin_ctz((unsigned)set);
+}
+
+// Number of covered bytes among the first `count`.
+[[nodiscard]] static int block_count_set(CharBlock const mask, int const count) {
+    auto const set = (uint32_t)_mm_movemask_epi8(mask) & ((1u << count) - 1u);
+    return __builtin_popcount(set);
+}
+
+#elif defined(__ARM_NEON)
+#define CLOX_SIMD
+#include <arm_neon.h>
+
+typedef uint8x16_t CharBlock;
+
+[[nodiscard]] static CharBlock block_load(char const* const aligned) {
+    return vld1q_u8((uint8_t const*)aligned);
+}
+
+[[nodiscard]] static CharBlock block_in_range(CharBlock const block, char const low, char const high) {
+    return vandq_u8(vcgeq_u8(block, vdupq_n_u8((uint8_t)low)), vcleq_u8(block, vdupq_n_u8((uint8_t)high)));
+}
+
+[[nodiscard]] static CharBlock block_equal(CharBlock const block, char const c) {
+    return vceqq_u8(block, vdupq_n_u8((uint8_t)c));
+}
+
+[[nodiscard]] static CharBlock block_or(CharBlock const a, CharBlock const b) {
+    return vorrq_u8(a, b);
+}
+
+// NEON has no movemask; narrowing the high nibble of every 16-bit pair packs
+// the 16 lanes into 4 bits each of a 64-bit word.
+[[nodiscard]] static uint64_t block_bits(CharBlock const mask) {
+    auto const narrowed = vshrn_n_u16(vreinterpretq_u16_u8(mask), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+[[nodiscard]] static int block_first_unset(CharBlock const mask) {
+    auto const unset = ~block_bits(mask);
+    return unset == 0 ? 16 : __builtin_ctzll(unset) / 4;
+}
+
+[[nodiscard]] static int block_first_set(CharBlock const mask) {
+    auto const set = block_bits(mask);
+    return set == 0 ? 16 : __builtin_ctzll(set) / 4;
+}
+
+[[nodiscard]] static int block_count_set(CharBlock const mask, int const count) {
+    auto bits = block_bits(mask);
+    if (count < 16) {
+        bits &= (1ull << (4 * count)) - 1ull;
+    }
+    return __builtin_popcountll(bits) / 4;
+}
+#endif
+
+#ifdef CLOX_SIMD
+
+// Runs the scalar predicate until `current` is 16-byte aligned; all kernels
+// share this shape so the aligned loads below stay in bounds.
+#define ALIGN_PREFIX(current, continue_condition) \
+    while (((uintptr_t)(current) % 16) != 0) { \
+        if (not (continue_condition)) { \
+            return current; \
+        } \
+        ++(current); \
+    }
+
+// Pointer to the first character after the identifier run starting at
+// `current`.
+[[nodiscard]] static char const* skip_identifier_run(char const* current) {
+    ALIGN_PREFIX(current, is_alpha(*current) or is_digit(*current))
+    for (;;) {
+        auto const block = block_load(current);
+        auto const mask = block_or(
+            block_or(block_in_range(block, 'a', 'z'), block_in_range(block, 'A', 'Z')),
+            block_or(block_in_range(block, '0', '9'), block_equal(block, '_'))
+        );
+        auto const stop = block_first_unset(mask);
+        current += stop;
+        if (stop < 16) {
+            return current;
+        }
+    }
+}
+
+// Pointer to the first non-digit after `current`.
+[[nodiscard]] static char const* skip_digit_run(char const* current) {
+    ALIGN_PREFIX(current, is_digit(*current))
+    for (;;) {
+        auto const stop = block_first_unset(block_in_range(block_load(current), '0', '9'));
+        current += stop;
+        if (stop < 16) {
+            return current;
+        }
+    }
+}
+
+// Pointer to the first non-whitespace character, bumping `*line` for every
+// newline skipped on the way.
+[[nodiscard]] static char const* skip_whitespace_run(char const* current, int* const line) {
+    while (((uintptr_t)current % 16) != 0) {
+        auto const c = *current;
+        if (c == '\n') {
+            ++*line;
+        } else if (c != ' ' and c != '\r' and c != '\t') {
+            return current;
+        }
+        ++current;
+    }
+    for (;;) {
+        auto const block = block_load(current);
+        auto const newlines = block_equal(block, '\n');
+        auto const mask =
+            block_or(block_or(block_equal(block, ' '), block_equal(block, '\t')), block_or(block_equal(block, '\r'), newlines));
+        auto const stop = block_first_unset(mask);
+        *line += block_count_set(newlines, stop);
+        current += stop;
+        if (stop < 16) {
+            return current;
+        }
+    }
+}
+
+// Pointer to the newline (or NUL) ending a line comment.
+[[nodiscard]] static char const* skip_line_comment(char const* current) {
+    ALIGN_PREFIX(current, *current != '\n' and *current != '\0')
+    for (;;) {
+        auto const block = block_load(current);
+        auto const stop = block_first_set(block_or(block_equal(block, '\n'), block_equal(block, '\0')));
+        current += stop;
+        if (stop < 16) {
+            return current;
+        }
+    }
+}
+
+// Pointer to the closing quote (or NUL) of a string literal, bumping `*line`
+// for every newline inside it.
+[[nodiscard]] static char const* skip_string_run(char const* current, int* const line) {
+    while (((uintptr_t)current % 16) != 0) {
+        auto const c = *current;
+        if (c == '"' or c == '\0') {
+            return current;
+        }
+        if (c == '\n') {
+            ++*line;
+        }
+        ++current;
+    }
     for (;;) {
-        auto const c = peek();
-        switch (c) {
+        auto const block = block_load(current);
+        auto const stop = block_first_set(block_or(block_equal(block, '"'), block_equal(block, '\0')));
+        *line += block_count_set(block_equal(block, '\n'), stop);
+        current += stop;
+        if (stop < 16) {
+            return current;
+        }
+    }
+}
+
+#undef ALIGN_PREFIX
+
+#else
+
+[[nodiscard]] static char const* skip_identifier_run(char const* current) {
+    while (is_alpha(*current) or is_digit(*current)) {
+        ++current;
+    }
+    return current;
+}
+
+[[nodiscard]] static char const* skip_digit_run(char const* current) {
+    while (is_digit(*current)) {
+        ++current;
+    }
+    return current;
+}
+
+[[nodiscard]] static char const* skip_whitespace_run(char const* current, int* const line) {
+    for (;;) {
+        switch (*current) {
+            case '\n':
+                ++*line;
+                [[fallthrough]];
             case ' ':
             case '\r':
             case '\t':
-                (void)advance();
+                ++current;
                 break;
-            case '\n':
-                ++scanner.line;
-                (void)advance();
-                break;
-            case '/':
-                if (peek_next() == '/') {
-                    // A comment goes until the end of the line.
-                    while (peek() != '\n' and not is_at_end()) {
-                        (void)advance();
-                    }
-                } else {
-                    return;
-                }
             default:
-                return;
+                return current;
         }
     }
 }
 
-[[nodiscard]] static Token string() {
-    while (peek() != '"' and not is_at_end()) {
-        if (peek() == '\n') {
-            ++scanner.line;
+[[nodiscard]] static char const* skip_line_comment(char const* current) {
+    while (*current != '\n' and *current != '\0') {
+        ++current;
+    }
+    return current;
+}
+
+[[nodiscard]] static char const* skip_string_run(char const* current, int* const line) {
+    while (*current != '"' and *current != '\0') {
+        if (*current == '\n') {
+            ++*line;
         }
-        (void)advance();
+        ++current;
     }
+    return current;
+}
+
+#endif
+
+static void skip_whitespace() {
+    for (;;) {
+        scanner.current = skip_whitespace_run(scanner.current, &scanner.line);
+        if (peek() == '/' and peek_next() == '/') {
+            // A comment goes until the end of the line.
+            scanner.current = skip_line_comment(scanner.current);
+        } else {
+            return;
+        }
+    }
+}
+
+[[nodiscard]] static Token string() {
+    scanner.current = skip_string_run(scanner.current, &scanner.line);
     if (is_at_end()) {
         return error_token("Unterminated string literal.");
     }
@@ -98,30 +345,17 @@ static void skip_whitespace() {
     return make_token(TOKEN_STRING);
 }
 
-[[nodiscard]] bool is_digit(char const c) {
-    return c >= '0' and c <= '9';
-}
-
 [[nodiscard]] static Token number() {
-    while (is_digit(peek())) {
-        (void)advance();
-    }
+    scanner.current = skip_digit_run(scanner.current);
 
     // Look for a fractional part.
     if (peek() == '.' and is_digit(peek_next())) {
         (void)advance();  // Consume the ".".
-
-        while (is_digit(peek())) {
-            (void)advance();
-        }
+        scanner.current = skip_digit_run(scanner.current);
     }
     return make_token(TOKEN_NUMBER);
 }
 
-[[nodiscard]] static bool is_alpha(char const c) {
-    return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z') or c == '_';
-}
-
 [[nodiscard]] TokenType check_keyword(int const start, int const length, char const* const rest, TokenType const type) {
     if (scanner.current - scanner.start == start + length and memcmp(scanner.start + start, rest, (size_t)length) == 0) {
         return type;
@@ -166,9 +400,7 @@ static void skip_whitespace() {
 }
 
 [[nodiscard]] static Token identifier() {
-    while (is_alpha(peek()) or is_digit(peek())) {
-        (void)advance();
-    }
+    scanner.current = skip_identifier_run(scanner.current);
     return make_token(identifier_type());
 }
 
@@ -200,6 +432,8 @@ void init_scanner(char const* const source) {
         case ')': return make_token(TOKEN_RIGHT_PAREN);
         case '{': return make_token(TOKEN_LEFT_BRACE);
         case '}': return make_token(TOKEN_RIGHT_BRACE);
+        case '[': return make_token(TOKEN_LEFT_BRACKET);
+        case ']': return make_token(TOKEN_RIGHT_BRACKET);
         case ';': return make_token(TOKEN_SEMICOLON);
         case ',': return make_token(TOKEN_COMMA);
         case '.': return make_token(TOKEN_DOT);
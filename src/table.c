@@ -4,144 +4,327 @@
 #include "memory.h"
 #include "object.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Resize when more than 7/8 of the slots are taken by elements or tombstones,
+// which also guarantees that every probe sequence eventually hits an empty
+// slot.
+#define TABLE_MAX_LOAD_NUMERATOR 7
+#define TABLE_MAX_LOAD_DENOMINATOR 8
+
+#define GROUP_SIZE 16
+
+// Control byte values. Full slots store the low seven hash bits (h2), so
+// their high bit is always clear.
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+// Murmur3-style finalizer, so that both the group index (high bits) and the
+// control fragment (low seven bits) of raw bit patterns are well mixed.
+[[nodiscard]] static uint64_t hash_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xFF51AFD7ED558CCDull;
+    bits ^= bits >> 33;
+    return bits;
+}
+
+// Strings hash via their cached hash (equal contents are interned to the same
+// object, so equal strings share it); every other value hashes its bit
+// pattern — the number bits, the object pointer, or the type tag.
+[[nodiscard]] static uint64_t hash_value(Value const value) {
+    if (IS_STRING(value)) {
+        return AS_STRING(value)->hash;
+    }
+#ifdef CLOX_NAN_BOXING
+    return hash_bits(value);
+#else
+    if (IS_NUMBER(value)) {
+        auto const number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return hash_bits(bits);
+    }
+    if (IS_OBJ(value)) {
+        return hash_bits((uint64_t)(uintptr_t)AS_OBJ(value));
+    }
+    return hash_bits(((uint64_t)value.type << 1) | (uint64_t)(IS_BOOL(value) and AS_BOOL(value)));
+#endif
+}
+
+[[nodiscard]] static uint8_t hash_fragment(uint64_t const hash) {
+    return (uint8_t)(hash & 0x7F);
+}
+
+[[nodiscard]] static uint32_t probe_start(uint64_t const hash, int const capacity) {
+    return (uint32_t)(hash >> 7) & ((uint32_t)capacity - 1) & ~(uint32_t)(GROUP_SIZE - 1);
+}
+
+// Bitmask of the control bytes in the group that equal the given fragment.
+[[nodiscard]] static uint32_t group_match(uint8_t const* const group, uint8_t const fragment) {
+#ifdef __SSE2__
+    auto const bytes = _mm_loadu_si128((__m128i const*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)fragment)));
+#else
+    auto mask = (uint32_t)0;
+    for (auto i = 0; i < GROUP_SIZE; ++i) {
+        if (group[i] == fragment) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+// Bitmask of the control bytes in the group that are empty (not deleted).
+[[nodiscard]] static uint32_t group_match_empty(uint8_t const* const group) {
+    return group_match(group, CTRL_EMPTY);
+}
+
+// Bitmask of the control bytes in the group that are empty or deleted.
+[[nodiscard]] static uint32_t group_match_available(uint8_t const* const group) {
+#ifdef __SSE2__
+    auto const bytes = _mm_loadu_si128((__m128i const*)group);
+    return (uint32_t)_mm_movemask_epi8(bytes);
+#else
+    auto mask = (uint32_t)0;
+    for (auto i = 0; i < GROUP_SIZE; ++i) {
+        if ((group[i] & 0x80) != 0) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+[[nodiscard]] static int first_set_bit(uint32_t const mask) {
+    for (auto bit = 0; bit < GROUP_SIZE; ++bit) {
+        if ((mask & (1u << bit)) != 0) {
+            return bit;
+        }
+    }
+    return -1;
+}
 
 void init_table(Table* const table) {
     table->capacity = 0;
     table->count = 0;
     table->entries = nullptr;
+    table->ctrl = nullptr;
 }
 
-void free_table(Table* const table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void free_table(VM* const vm, Table* const table) {
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, uint8_t, table->ctrl, table->capacity);
     init_table(table);
 }
 
-[[nodiscard]] static Entry* find_entry(Entry* const entries, int const capacity, ObjString const* const key) {
-    auto index = key->hash % (uint32_t)capacity;
-    auto tombstone = (Entry*)nullptr;
+// Index of the slot holding the key, or -1 if it is not present.
+[[nodiscard]] static int find_existing(Table const* const table, Value const key, uint64_t const hash) {
+    auto const mask = (uint32_t)table->capacity - 1;
+    auto const fragment = hash_fragment(hash);
+    auto group_start = probe_start(hash, table->capacity);
     for (;;) {
-        auto const entry = &entries[index];
-        if (entry->key == nullptr) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != nullptr ? tombstone : entry;
+        auto const group = table->ctrl + group_start;
+        auto matches = group_match(group, fragment);
+        while (matches != 0) {
+            auto const bit = first_set_bit(matches);
+            auto const index = (int)(group_start + (uint32_t)bit);
+            if (values_equal(table->entries[index].key, key)) {
+                return index;
             }
-            // We found a tombstone.
-            if (tombstone == nullptr) {
-                tombstone = entry;
+            matches &= matches - 1;
+        }
+        if (group_match_empty(group) != 0) {
+            return -1;
+        }
+        group_start = (group_start + GROUP_SIZE) & mask;
+    }
+}
+
+// Slot to store the key into: its existing slot, or the first reusable
+// (deleted, then empty) slot along its probe sequence.
+[[nodiscard]] static int find_insert_slot(Table const* const table, Value const key, uint64_t const hash) {
+    auto const mask = (uint32_t)table->capacity - 1;
+    auto const fragment = hash_fragment(hash);
+    auto group_start = probe_start(hash, table->capacity);
+    auto first_deleted = -1;
+    for (;;) {
+        auto const group = table->ctrl + group_start;
+        auto matches = group_match(group, fragment);
+        while (matches != 0) {
+            auto const bit = first_set_bit(matches);
+            auto const index = (int)(group_start + (uint32_t)bit);
+            if (values_equal(table->entries[index].key, key)) {
+                return index;
             }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+            matches &= matches - 1;
         }
 
-        index = (index + 1) % (uint32_t)capacity;
+        auto const empty = group_match_empty(group);
+        if (first_deleted == -1) {
+            auto const deleted = group_match_available(group) & ~empty;
+            if (deleted != 0) {
+                first_deleted = (int)(group_start + (uint32_t)first_set_bit(deleted));
+            }
+        }
+        if (empty != 0) {
+            if (first_deleted != -1) {
+                return first_deleted;
+            }
+            return (int)(group_start + (uint32_t)first_set_bit(empty));
+        }
+        group_start = (group_start + GROUP_SIZE) & mask;
     }
 }
 
-[[nodiscard]] bool table_get(Table const* const table, ObjString const* const key, Value* const value) {
+[[nodiscard]] bool table_get(Table const* const table, Value const key, Value* const value) {
     if (table->count == 0) {
         return false;
     }
 
-    auto const entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == nullptr) {
+    auto const index = find_existing(table, key, hash_value(key));
+    if (index == -1) {
         return false;
     }
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
-static void adjust_capacity(Table* const table, int const capacity) {
-    auto const entries = ALLOCATE(Entry, capacity);
+// Places an entry into freshly rebuilt arrays, which are guaranteed to hold
+// no duplicates of the key and no tombstones.
+static void insert_fresh(uint8_t* const ctrl, Entry* const entries, int const capacity, Entry const* const entry) {
+    auto const mask = (uint32_t)capacity - 1;
+    auto const hash = hash_value(entry->key);
+    auto group_start = probe_start(hash, capacity);
+    for (;;) {
+        auto const empty = group_match_empty(ctrl + group_start);
+        if (empty != 0) {
+            auto const index = (int)(group_start + (uint32_t)first_set_bit(empty));
+            ctrl[index] = hash_fragment(hash);
+            entries[index] = *entry;
+            return;
+        }
+        group_start = (group_start + GROUP_SIZE) & mask;
+    }
+}
+
+static void adjust_capacity(VM* const vm, Table* const table, int const capacity) {
+    auto const entries = ALLOCATE(vm, Entry, capacity);
     for (auto i = 0; i < capacity; ++i) {
-        entries[i].key = nullptr;
+        entries[i].key = UNDEFINED_VAL;
         entries[i].value = NIL_VAL;
     }
+    auto const ctrl = ALLOCATE(vm, uint8_t, capacity);
+    memset(ctrl, CTRL_EMPTY, (size_t)capacity);
 
     table->count = 0;
     for (auto i = 0; i < table->capacity; ++i) {
         auto const entry = &table->entries[i];
-        if (entry->key == nullptr) {
+        if (IS_UNDEFINED(entry->key)) {
             continue;
         }
-        auto const dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        insert_fresh(ctrl, entries, capacity, entry);
         ++table->count;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, uint8_t, table->ctrl, table->capacity);
 
     table->entries = entries;
+    table->ctrl = ctrl;
     table->capacity = capacity;
 }
 
-bool table_set(Table* const table, ObjString* const key, Value const value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        auto const capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+bool table_set(VM* const vm, Table* const table, Value const key, Value const value) {
+    if ((table->count + 1) * TABLE_MAX_LOAD_DENOMINATOR > table->capacity * TABLE_MAX_LOAD_NUMERATOR) {
+        auto const capacity = table->capacity < GROUP_SIZE ? GROUP_SIZE : table->capacity * 2;
+        adjust_capacity(vm, table, capacity);
     }
 
-    auto const entry = find_entry(table->entries, table->capacity, key);
-    auto const is_new_key = (entry->key == nullptr);
-    if (is_new_key && IS_NIL(entry->value)) {
+    auto const hash = hash_value(key);
+    auto const index = find_insert_slot(table, key, hash);
+    auto const entry = &table->entries[index];
+    auto const is_new_key = IS_UNDEFINED(entry->key);
+    if (is_new_key and table->ctrl[index] == CTRL_EMPTY) {
         ++table->count;
     }
 
+    table->ctrl[index] = hash_fragment(hash);
     entry->key = key;
     entry->value = value;
     return is_new_key;
 }
 
-bool table_delete(Table const* table, ObjString const* key) {
+bool table_delete(Table const* table, Value const key) {
     if (table->count == 0) {
         return false;
     }
 
-    // Find the entry.
-    auto const entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == nullptr) {
+    auto const index = find_existing(table, key, hash_value(key));
+    if (index == -1) {
         return false;
     }
 
-    // Place a tombstone in the entry.
-    entry->key = nullptr;
-    entry->value = BOOL_VAL(true);
+    // Mark the slot as deleted; it stays a tombstone until the next resize.
+    table->ctrl[index] = CTRL_DELETED;
+    table->entries[index].key = UNDEFINED_VAL;
+    table->entries[index].value = NIL_VAL;
     return true;
 }
 
-void table_add_all(Table* const from, Table* const to) {
+void table_add_all(VM* const vm, Table* const from, Table* const to) {
     for (auto i = 0; i < from->capacity; ++i) {
         auto const entry = &from->entries[i];
-        if (entry->key != nullptr) {
-            table_set(to, entry->key, entry->value);
+        if (not IS_UNDEFINED(entry->key)) {
+            table_set(vm, to, entry->key, entry->value);
+        }
+    }
+}
+
+void table_remove_white(Table const* const table) {
+    for (auto i = 0; i < table->capacity; ++i) {
+        auto const entry = &table->entries[i];
+        if (IS_OBJ(entry->key) and not AS_OBJ(entry->key)->is_marked) {
+            table_delete(table, entry->key);
         }
     }
 }
 
+void mark_table(VM* const vm, Table const* const table) {
+    for (auto i = 0; i < table->capacity; ++i) {
+        auto const entry = &table->entries[i];
+        mark_value(vm, entry->key);
+        mark_value(vm, entry->value);
+    }
+}
+
 [[nodiscard]] ObjString const*
-    table_find_string(Table const* const table, char const* const chars, int const length, uint32_t const hash) {
+    table_find_string(Table const* const table, char const* const chars, int const length, uint64_t const hash) {
     if (table->count == 0) {
         return nullptr;
     }
 
-    auto index = hash % (uint32_t)table->capacity;
+    auto const mask = (uint32_t)table->capacity - 1;
+    auto const fragment = hash_fragment(hash);
+    auto group_start = probe_start(hash, table->capacity);
     for (;;) {
-        auto const entry = &table->entries[index];
-        if (entry->key == nullptr) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) {
-                return nullptr;
+        auto const group = table->ctrl + group_start;
+        auto matches = group_match(group, fragment);
+        while (matches != 0) {
+            auto const bit = first_set_bit(matches);
+            // Only called on the intern table, whose keys are all strings.
+            auto const key = AS_STRING(table->entries[group_start + (uint32_t)bit].key);
+            if (key->length == length and key->hash == hash and memcmp(key->chars, chars, (size_t)length) == 0) {
+                return key;
             }
-        } else if (entry->key->length == length and entry->key->hash == hash
-                   and memcmp(entry->key->chars, chars, (size_t)length) == 0) {
-            // We found it.
-            return entry->key;
+            matches &= matches - 1;
         }
-
-        index = (index + 1) % (uint32_t)table->capacity;
+        if (group_match_empty(group) != 0) {
+            return nullptr;
+        }
+        group_start = (group_start + GROUP_SIZE) & mask;
     }
 }
@@ -4,20 +4,31 @@
 #include "value.h"
 
 typedef struct {
-    ObjString* key;
+    Value key;
     Value value;
 } Entry;
 
+// Open-addressed hash table with Swiss-table style group probing: a parallel
+// array of one-byte controls holds seven hash bits per slot (or an
+// empty/deleted marker), so a probe step scans 16 slots at once — with SSE2
+// where available — before ever touching an Entry. Keys are arbitrary values
+// (strings hash via their cached hash; everything else hashes its bit
+// pattern), with UNDEFINED_VAL — which scripts can never produce — marking
+// empty and deleted slots, so `not IS_UNDEFINED(key)` iteration over
+// `entries` finds exactly the live entries.
 typedef struct {
     int count; // total number of elements and tombstones
-    int capacity;
+    int capacity; // always zero or a power of two >= the group size
     Entry* entries;
+    uint8_t* ctrl;
 } Table;
 
 void init_table(Table* table);
-void free_table(Table* table);
-[[nodiscard]] bool table_get(Table const* table, ObjString const* key, Value* value);
-bool table_set(Table* table, ObjString* key, Value value);
-bool table_delete(Table const* table, ObjString const* key);
-void table_add_all(Table* from, Table* to);
-[[nodiscard]] ObjString const* table_find_string(Table const* table, char const* chars, int length, uint32_t hash);
+void free_table(VM* vm, Table* table);
+[[nodiscard]] bool table_get(Table const* table, Value key, Value* value);
+bool table_set(VM* vm, Table* table, Value key, Value value);
+bool table_delete(Table const* table, Value key);
+void table_add_all(VM* vm, Table* from, Table* to);
+[[nodiscard]] ObjString const* table_find_string(Table const* table, char const* chars, int length, uint64_t hash);
+void table_remove_white(Table const* table);
+void mark_table(VM* vm, Table const* table);
@@ -0,0 +1,77 @@
+#include "tracer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chunk.h"
+#include "vm.h"
+
+thread_local Tracer tracer;
+
+void init_tracer() {
+    memset(&tracer, 0, sizeof(tracer));
+}
+
+void free_tracer() {
+    free(tracer.records);
+    memset(&tracer, 0, sizeof(tracer));
+}
+
+bool tracer_set_enabled(bool const enabled) {
+    auto const was_enabled = tracer.enabled;
+    if (enabled and tracer.records == nullptr) {
+        // Raw allocation (like the profiler's bookkeeping): the ring is not
+        // part of the collected heap.
+        tracer.records = (TraceRecord*)calloc(TRACE_RING_CAPACITY, sizeof(TraceRecord));
+        if (tracer.records == nullptr) {
+            exit(1);
+        }
+    }
+    tracer.enabled = enabled;
+    return was_enabled;
+}
+
+// Whether the function pointer still refers to a live object. Records can
+// outlive the functions they point into (a collected closure, an earlier
+// daemon request), so the dump only symbolizes through pointers it finds on
+// the VM's object list; everything else is printed as collected. The linear
+// scan is fine here — dumping only happens on the error path.
+[[nodiscard]] static bool is_live_function(VM const* const vm, ObjFunction const* const function) {
+    for (auto object = vm->objects; object != nullptr; object = object->next) {
+        if (object == (Obj const*)function) {
+            return object->type == OBJ_FUNCTION;
+        }
+    }
+    return false;
+}
+
+void tracer_dump(VM const* const vm) {
+    if (tracer.records == nullptr or tracer.next == 0) {
+        return;
+    }
+
+    auto const recorded = tracer.next < TRACE_RING_CAPACITY ? tracer.next : (uint32_t)TRACE_RING_CAPACITY;
+    fprintf(stderr, "== trace (%u most recent instructions, oldest first) ==\n", recorded);
+    fprintf(stderr, "depth stack offset opcode                function\n");
+    for (auto i = tracer.next - recorded; i != tracer.next; ++i) {
+        auto const record = &tracer.records[i & (TRACE_RING_CAPACITY - 1)];
+        fprintf(
+            stderr,
+            "%5u %5u   %04u %-21s ",
+            record->frame_depth,
+            record->stack_height,
+            record->offset,
+            opcode_name(record->opcode)
+        );
+        auto const function = record->function;
+        if (is_live_function(vm, function) and (int)record->offset < function->chunk.count) {
+            fprintf(
+                stderr,
+                "%s (line %d)\n",
+                function->name == nullptr ? "<script>" : function->name->chars,
+                chunk_line(&function->chunk, (int)record->offset)
+            );
+        } else {
+            fprintf(stderr, "<collected>\n");
+        }
+    }
+}
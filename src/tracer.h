@@ -0,0 +1,60 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+// Always-compiled flight recorder: while enabled (via the trace() native),
+// every dispatched instruction appends a compact record — a few plain stores
+// — to a fixed-size in-memory ring, and runtime_error() dumps the ring as
+// symbolized disassembly so production incidents leave a post-mortem trail.
+// Unlike DEBUG_TRACE_EXECUTION, nothing is formatted or printed on the hot
+// path. When disabled, the only cost is one predictable branch per dispatch.
+
+// Must be a power of two; 4096 records cover the last few thousand
+// instructions in 64 KiB per thread.
+#define TRACE_RING_CAPACITY 4096
+
+typedef struct {
+    // Only dereferenced at dump time, after checking that the function is
+    // still on the VM's live object list (see tracer_dump()).
+    ObjFunction const* function;
+    uint32_t offset;  // bytecode offset of the instruction
+    uint8_t opcode;
+    uint8_t frame_depth;  // clamped to 255
+    uint16_t stack_height;  // in slots, clamped to 65535
+} TraceRecord;
+
+typedef struct {
+    bool enabled;
+    // Lazily allocated ring (raw allocation, not part of the collected
+    // heap). `next` counts all writes; the slot is `next` modulo capacity.
+    TraceRecord* records;
+    uint32_t next;
+} Tracer;
+
+// Per-thread, matching the one-VM-per-worker-thread model; no locking or
+// atomics are needed on the write path.
+extern thread_local Tracer tracer;
+
+void init_tracer();
+void free_tracer();
+// Enables or disables recording, allocating the ring on first use. Returns
+// whether recording was enabled before.
+bool tracer_set_enabled(bool enabled);
+void tracer_dump(VM const* vm);
+
+static inline void tracer_record(
+    ObjFunction const* const function,
+    int const offset,
+    uint8_t const opcode,
+    int const frame_depth,
+    int const stack_height
+) {
+    auto const record = &tracer.records[tracer.next & (TRACE_RING_CAPACITY - 1)];
+    record->function = function;
+    record->offset = (uint32_t)offset;
+    record->opcode = opcode;
+    record->frame_depth = frame_depth > UINT8_MAX ? UINT8_MAX : (uint8_t)frame_depth;
+    record->stack_height = stack_height > UINT16_MAX ? UINT16_MAX : (uint16_t)stack_height;
+    ++tracer.next;
+}
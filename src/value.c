@@ -1,49 +1,140 @@
 #include "value.h"
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include "memory.h"
 #include "object.h"
 
+// All interpreter output funnels through this buffer (thread_local, like the
+// profiler and tracer state, since each VM runs on its own thread) and is
+// flushed explicitly at the few points where ordering with the outside world
+// matters: the REPL prompt, stdin reads, error reports, and shutdown. One
+// fwrite() per 64 KiB replaces a locked stdio call per print statement.
+#define PRINT_BUFFER_CAPACITY (64 * 1024)
+static thread_local char print_buffer[PRINT_BUFFER_CAPACITY];
+static thread_local int print_buffer_count = 0;
+
+void print_flush() {
+    if (print_buffer_count > 0) {
+        fwrite(print_buffer, 1, (size_t)print_buffer_count, stdout);
+        print_buffer_count = 0;
+    }
+}
+
+void print_chars(char const* const chars, int const length) {
+    if (length > PRINT_BUFFER_CAPACITY - print_buffer_count) {
+        print_flush();
+        if (length > PRINT_BUFFER_CAPACITY) {
+            // Larger than the whole buffer; hand it to stdio directly.
+            fwrite(chars, 1, (size_t)length, stdout);
+            return;
+        }
+    }
+    memcpy(&print_buffer[print_buffer_count], chars, (size_t)length);
+    print_buffer_count += length;
+}
+
+void print_text(char const* const text) {
+    print_chars(text, (int)strlen(text));
+}
+
+[[nodiscard]] int format_number(double const value, char* const buffer) {
+    // %g switches to exponent notation at seven significant digits, so only
+    // whole numbers below a million are literally their digit strings. Those
+    // cover the overwhelming share of printed numbers (counters, indices,
+    // sizes) and skip float formatting entirely. The range check runs first:
+    // casting an out-of-range double would be undefined.
+    if (value > -1e6 and value < 1e6 and value == (double)(int32_t)value) {
+        auto integer = (int32_t)value;
+        auto cursor = buffer;
+        if (integer < 0 or (integer == 0 and signbit(value))) {
+            *cursor++ = '-';
+            integer = -integer;
+        }
+        char digits[8];
+        auto count = 0;
+        do {
+            digits[count++] = (char)('0' + integer % 10);
+            integer /= 10;
+        } while (integer > 0);
+        while (count > 0) {
+            *cursor++ = digits[--count];
+        }
+        *cursor = '\0';
+        return (int)(cursor - buffer);
+    }
+    return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", value);
+}
+
+static void print_number(double const value) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    print_chars(buffer, format_number(value, buffer));
+}
+
 void init_value_array(ValueArray* const array) {
     array->values = nullptr;
     array->capacity = 0;
     array->count = 0;
 }
 
-void write_value_array(ValueArray* const array, Value const value) {
+void write_value_array(VM* const vm, ValueArray* const array, Value const value) {
     if (array->capacity < array->count + 1) {
         auto const old_capacity = array->capacity;
         array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, old_capacity, array->capacity);
     }
 
     array->values[array->count] = value;
     ++(array->count);
 }
 
-void free_value_array(ValueArray* const array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void free_value_array(VM* const vm, ValueArray* const array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     init_value_array(array);
 }
 
 void print_value(Value const value) {
+#ifdef CLOX_NAN_BOXING
+    if (IS_BOOL(value)) {
+        print_text(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        print_text("nil");
+    } else if (IS_NUMBER(value)) {
+        print_number(AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        print_object(value);
+    }
+#else
     switch (value.type) {
         case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            print_text(AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_NIL:
-            printf("nil");
+            print_text("nil");
             break;
         case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
+            print_number(AS_NUMBER(value));
             break;
         case VAL_OBJ:
             print_object(value);
             break;
+        case VAL_UNDEFINED:
+            print_text("undefined");
+            break;
     }
+#endif
 }
 
 [[nodiscard]] bool values_equal(Value const a, Value const b) {
+#ifdef CLOX_NAN_BOXING
+    // Numbers must compare by value so that NaN != NaN holds; every other
+    // value compares by bit pattern (strings are interned, so pointer
+    // identity is content identity).
+    if (IS_NUMBER(a) and IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) {
         return false;
     }
@@ -51,9 +142,11 @@ void print_value(Value const value) {
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
-        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
-        default:         return false; // Unreachable.
+        case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_UNDEFINED: return true;
+        default:            return false; // Unreachable.
     }
     // clang-format on
+#endif
 }
@@ -1,15 +1,68 @@
 #pragma once
 
+#include <string.h>
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef CLOX_NAN_BOXING
+
+// All non-number values are packed into the payload bits of a quiet NaN, so a
+// Value is a single 8-byte double. A real double never has all quiet-NaN bits
+// set at once, so the remaining 51 bits (plus the sign bit) are free for our
+// own tags and object pointers.
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1  // 001.
+#define TAG_FALSE 2  // 010.
+#define TAG_TRUE 3  // 011.
+#define TAG_UNDEFINED 4  // 100.
+
+[[nodiscard]] static inline Value number_to_value(double const number) {
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+[[nodiscard]] static inline double value_to_number(Value const value) {
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+// clang-format off
+#define IS_BOOL(value)     (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)      ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value)   (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)      (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)     ((value) == TRUE_VAL)
+#define AS_NUMBER(value)   value_to_number(value)
+#define AS_OBJ(value)      ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(value)    ((value) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL          ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL           ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL            ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL      ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(value)  number_to_value(value)
+#define OBJ_VAL(object)    ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)))
+// clang-format on
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    // Internal sentinel for unset global slots; never observable by scripts.
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -27,6 +80,7 @@ typedef struct {
 #define IS_NIL(value)      ((value).type == VAL_NIL)
 #define IS_NUMBER(value)   ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)      ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)     ((value).as.boolean)
 #define AS_NUMBER(value)   ((value).as.number)
@@ -34,18 +88,33 @@ typedef struct {
 
 #define BOOL_VAL(value)    ((Value){ VAL_BOOL,   { .boolean = value        } })
 #define NIL_VAL            ((Value){ VAL_NIL,    { .number  = 0            } })
+#define UNDEFINED_VAL      ((Value){ VAL_UNDEFINED, { .number = 0          } })
 #define NUMBER_VAL(value)  ((Value){ VAL_NUMBER, { .number  = value        } })
 #define OBJ_VAL(object)    ((Value){ VAL_OBJ,    { .obj     = (Obj*)object } })
 // clang-format on
 
+#endif
+
 typedef struct {
     int capacity;
     int count;
     Value* values;
 } ValueArray;
 
+// Large enough for any %g-formatted double, sign and terminator included.
+#define NUMBER_BUFFER_SIZE 32
+
 [[nodiscard]] bool values_equal(Value a, Value b);
 void init_value_array(ValueArray* array);
-void write_value_array(ValueArray* array, Value value);
-void free_value_array(ValueArray* array);
+void write_value_array(VM* vm, ValueArray* array, Value value);
+void free_value_array(VM* vm, ValueArray* array);
+// Writes the number the way printf("%g") would, with an integer fast path;
+// the buffer must hold NUMBER_BUFFER_SIZE bytes. Returns the length written.
+[[nodiscard]] int format_number(double value, char* buffer);
+// Buffered output used by print_value()/print_object() and the print
+// statement; print_flush() forces pending output to stdout wherever ordering
+// with unbuffered I/O matters.
+void print_chars(char const* chars, int length);
+void print_text(char const* text);
+void print_flush();
 void print_value(Value value);
@@ -2,29 +2,35 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "compiler.h"
 #include "debug.h"
+#include "loxb.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
+#include "tracer.h"
 
-VM vm;
-
-static Value clock_native(int, Value*) {
+static Value clock_native(VM*, int, Value*) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static Value read_number_native(int const args_count, Value* const args) {
+static Value read_number_native(VM*, int const args_count, Value* const args) {
     switch (args_count) {
         case 1:
             if (not IS_STRING(args[0])) {
                 return NUMBER_VAL(0.0);
             }
-            printf("%s", AS_CSTRING(args[0]));
+            print_text(AS_CSTRING(args[0]));
             [[fallthrough]];
         case 0: {
+            // The prompt (and any pending script output) must reach the
+            // terminal before we block on stdin.
+            print_flush();
+            fflush(stdout);
             auto result = 0.0;
             if (scanf("%lf", &result) == 0) {
                 return NUMBER_VAL(0.0);
@@ -37,24 +43,322 @@ static Value read_number_native(int const args_count, Value* const args) {
     }
 }
 
-static void reset_stack() {
-    vm.stack_top = vm.stack;
-    vm.frame_count = 0;
-    vm.open_upvalues = nullptr;
+static Value string_builder_native(VM* const vm, int, Value*) {
+    return OBJ_VAL(new_string_builder(vm));
+}
+
+static Value append_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count < 1 or not IS_STRING_BUILDER(args[0])) {
+        // Invalid arguments.
+        return NIL_VAL;
+    }
+    auto const builder = AS_STRING_BUILDER(args[0]);
+    for (auto i = 1; i < args_count; ++i) {
+        if (IS_STRING(args[i])) {
+            auto const string = AS_STRING(args[i]);
+            string_builder_append(vm, builder, string->chars, string->length);
+        } else if (IS_NUMBER(args[i])) {
+            char buffer[NUMBER_BUFFER_SIZE];
+            auto const length = format_number(AS_NUMBER(args[i]), buffer);
+            string_builder_append(vm, builder, buffer, length);
+        }
+    }
+    // Return the builder itself to allow chaining.
+    return args[0];
+}
+
+static Value build_string_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count != 1 or not IS_STRING_BUILDER(args[0])) {
+        // Invalid arguments.
+        return NIL_VAL;
+    }
+    auto const builder = AS_STRING_BUILDER(args[0]);
+    return OBJ_VAL(copy_string(vm, builder->chars != nullptr ? builder->chars : "", builder->length));
+}
+
+static Value list_native(VM* const vm, int, Value*) {
+    return OBJ_VAL(new_list(vm));
+}
+
+static Value push_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count < 1 or not IS_LIST(args[0])) {
+        // Invalid arguments.
+        return NIL_VAL;
+    }
+    auto const list = AS_LIST(args[0]);
+    for (auto i = 1; i < args_count; ++i) {
+        write_value_array(vm, &list->items, args[i]);
+    }
+    // Return the list itself to allow chaining.
+    return args[0];
+}
+
+static Value pop_native(VM*, int const args_count, Value* const args) {
+    if (args_count != 1 or not IS_LIST(args[0])) {
+        // Invalid arguments.
+        return NIL_VAL;
+    }
+    auto const list = AS_LIST(args[0]);
+    if (list->items.count == 0) {
+        return NIL_VAL;
+    }
+    // The buffer is only ever grown, so popping is a plain decrement.
+    return list->items.values[--list->items.count];
+}
+
+static Value len_native(VM*, int const args_count, Value* const args) {
+    if (args_count == 1) {
+        if (IS_LIST(args[0])) {
+            return NUMBER_VAL((double)AS_LIST(args[0])->items.count);
+        }
+        if (IS_MAP(args[0])) {
+            return NUMBER_VAL((double)AS_MAP(args[0])->count);
+        }
+        if (IS_STRING(args[0])) {
+            return NUMBER_VAL((double)AS_STRING(args[0])->length);
+        }
+    }
+    // Invalid arguments.
+    return NIL_VAL;
+}
+
+static Value map_native(VM* const vm, int, Value*) {
+    return OBJ_VAL(new_map(vm));
+}
+
+static Value map_get_native(VM*, int const args_count, Value* const args) {
+    if (args_count != 2 or not IS_MAP(args[0])) {
+        // Invalid arguments.
+        return NIL_VAL;
+    }
+    Value value;
+    if (table_get(&AS_MAP(args[0])->table, args[1], &value)) {
+        return value;
+    }
+    // An absent key reads as nil, like an undefined-but-declared variable.
+    return NIL_VAL;
+}
+
+static Value map_set_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count != 3 or not IS_MAP(args[0])) {
+        // Invalid arguments.
+        return NIL_VAL;
+    }
+    auto const map = AS_MAP(args[0]);
+    if (table_set(vm, &map->table, args[1], args[2])) {
+        ++map->count;
+    }
+    // Return the map itself to allow chaining.
+    return args[0];
+}
+
+static Value map_delete_native(VM*, int const args_count, Value* const args) {
+    if (args_count != 2 or not IS_MAP(args[0])) {
+        // Invalid arguments.
+        return BOOL_VAL(false);
+    }
+    auto const map = AS_MAP(args[0]);
+    auto const deleted = table_delete(&map->table, args[1]);
+    if (deleted) {
+        --map->count;
+    }
+    return BOOL_VAL(deleted);
+}
+
+// Snapshot of the keys as a list, so scripts can iterate a map by index.
+static Value map_keys_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count != 1 or not IS_MAP(args[0])) {
+        // Invalid arguments.
+        return NIL_VAL;
+    }
+    auto const map = AS_MAP(args[0]);
+    auto const list = new_list(vm);
+    // Keep the list reachable while its buffer grows.
+    push(vm, OBJ_VAL(list));
+    for (auto i = 0; i < map->table.capacity; ++i) {
+        auto const entry = &map->table.entries[i];
+        if (not IS_UNDEFINED(entry->key)) {
+            write_value_array(vm, &list->items, entry->key);
+        }
+    }
+    return pop(vm);
+}
+
+// The map returned by memory_stats() is rooted by the caller; the freshly
+// interned key still needs a stack slot while the table grows.
+static void stats_set(VM* const vm, ObjMap* const map, char const* const name, double const value) {
+    push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+    if (table_set(vm, &map->table, vm->stack_top[-1], NUMBER_VAL(value))) {
+        ++map->count;
+    }
+    (void)pop(vm);
+}
+
+// Returns a map of allocator statistics: current, peak, and limit heap bytes
+// (limit 0 meaning unlimited), the next collection threshold, and the number
+// of live objects of each type.
+static Value memory_stats_native(VM* const vm, int, Value*) {
+    static char const* const type_names[OBJ_TYPE_COUNT] = {
+        [OBJ_CLOSURE] = "closures",
+        [OBJ_FIBER] = "fibers",
+        [OBJ_FUNCTION] = "functions",
+        [OBJ_LIST] = "lists",
+        [OBJ_MAP] = "maps",
+        [OBJ_NATIVE] = "natives",
+        [OBJ_STRING] = "strings",
+        [OBJ_STRING_BUILDER] = "string_builders",
+        [OBJ_UPVALUE] = "upvalues",
+    };
+
+    auto const map = new_map(vm);
+    push(vm, OBJ_VAL(map));
+    stats_set(vm, map, "bytes", (double)vm->bytes_allocated);
+    stats_set(vm, map, "peak", (double)vm->peak_allocated);
+    stats_set(vm, map, "limit", vm->memory_limit == SIZE_MAX ? 0.0 : (double)vm->memory_limit);
+    stats_set(vm, map, "next_gc", (double)vm->next_gc);
+    for (auto type = 0; type < OBJ_TYPE_COUNT; ++type) {
+        stats_set(vm, map, type_names[type], (double)vm->object_counts[type]);
+    }
+    return pop(vm);
+}
+
+// Sets the hard heap limit in bytes (0 lifts it) and returns the previous
+// limit, again with 0 meaning unlimited. The limit is never lowered below
+// the current usage, mirroring stack_limits().
+static Value memory_limit_native(VM* const vm, int const args_count, Value* const args) {
+    auto const previous = vm->memory_limit == SIZE_MAX ? 0.0 : (double)vm->memory_limit;
+    if (args_count == 1 and IS_NUMBER(args[0])) {
+        auto const limit = AS_NUMBER(args[0]);
+        if (limit <= 0) {
+            vm->memory_limit = SIZE_MAX;
+        } else {
+            auto const requested = (size_t)limit;
+            vm->memory_limit = requested < vm->bytes_allocated ? vm->bytes_allocated : requested;
+        }
+    }
+    return NUMBER_VAL(previous);
+}
+
+// Sets the maximum call depth and value-stack size (in slots). Limits are
+// never lowered below what the VM currently has allocated.
+static Value stack_limits_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count == 2 and IS_NUMBER(args[0]) and IS_NUMBER(args[1])) {
+        auto const frame_limit = (int)AS_NUMBER(args[0]);
+        auto const stack_limit = (int)AS_NUMBER(args[1]);
+        if (frame_limit > 0) {
+            vm->frame_limit = frame_limit < vm->frame_capacity ? vm->frame_capacity : frame_limit;
+        }
+        if (stack_limit > 0) {
+            vm->stack_limit = stack_limit < vm->stack_capacity ? vm->stack_capacity : stack_limit;
+        }
+    }
+    return NIL_VAL;
+}
+
+// Enables or disables profiling (see profiler.h) and returns whether it was
+// enabled before, so scripts can restore the previous state.
+static Value profile_native(VM*, int const args_count, Value* const args) {
+    auto const was_enabled = profiler.enabled;
+    if (args_count == 1 and IS_BOOL(args[0])) {
+        profiler.enabled = AS_BOOL(args[0]);
+    }
+    return BOOL_VAL(was_enabled);
+}
+
+// Enables or disables the execution flight recorder (see tracer.h) and
+// returns whether it was enabled before.
+static Value trace_native(VM*, int const args_count, Value* const args) {
+    if (args_count == 1 and IS_BOOL(args[0])) {
+        return BOOL_VAL(tracer_set_enabled(AS_BOOL(args[0])));
+    }
+    return BOOL_VAL(tracer.enabled);
+}
+
+// Dumps the recorded ring to stderr on demand, without waiting for an error.
+static Value trace_dump_native(VM* const vm, int, Value*) {
+    tracer_dump(vm);
+    return NIL_VAL;
+}
+
+// Writes the current globals to a snapshot file that a later run can load
+// via --restore instead of recompiling the prelude. Returns whether the
+// snapshot was written.
+static Value snapshot_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count != 1 or not IS_STRING(args[0])) {
+        return BOOL_VAL(false);
+    }
+    return BOOL_VAL(loxb_write_snapshot(vm, AS_CSTRING(args[0])));
+}
+
+// Defined below call_value(), which the fiber natives build on.
+static Value fiber_native(VM* vm, int args_count, Value* args);
+static Value resume_native(VM* vm, int args_count, Value* args);
+static Value yield_native(VM* vm, int args_count, Value* args);
+static Value fiber_done_native(VM* vm, int args_count, Value* args);
+
+static void reset_stack(VM* const vm) {
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
+    vm->open_upvalue_count = 0;
+}
+
+// A fiber switch moves the execution context (call frames, value stack, open
+// upvalues) between the VM and a fiber object. The context is owned by
+// exactly one of the two at any time: restoring clears the fiber's copy, so
+// the arrays can never be freed twice.
+static void save_context(VM* const vm, ObjFiber* const fiber) {
+    fiber->frames = vm->frames;
+    fiber->frame_count = vm->frame_count;
+    fiber->frame_capacity = vm->frame_capacity;
+    fiber->stack = vm->stack;
+    fiber->stack_top = vm->stack_top;
+    fiber->stack_capacity = vm->stack_capacity;
+    fiber->open_upvalues = vm->open_upvalues;
+    fiber->open_upvalue_count = vm->open_upvalue_count;
+    fiber->open_upvalue_capacity = vm->open_upvalue_capacity;
+}
+
+static void restore_context(VM* const vm, ObjFiber* const fiber) {
+    vm->frames = fiber->frames;
+    vm->frame_count = fiber->frame_count;
+    vm->frame_capacity = fiber->frame_capacity;
+    vm->stack = fiber->stack;
+    vm->stack_top = fiber->stack_top;
+    vm->stack_capacity = fiber->stack_capacity;
+    vm->open_upvalues = fiber->open_upvalues;
+    vm->open_upvalue_count = fiber->open_upvalue_count;
+    vm->open_upvalue_capacity = fiber->open_upvalue_capacity;
+    fiber->frames = nullptr;
+    fiber->frame_count = 0;
+    fiber->frame_capacity = 0;
+    fiber->stack = nullptr;
+    fiber->stack_top = nullptr;
+    fiber->stack_capacity = 0;
+    fiber->open_upvalues = nullptr;
+    fiber->open_upvalue_count = 0;
+    fiber->open_upvalue_capacity = 0;
 }
 
-static void runtime_error(char const* const format, ...) {
+static void runtime_error(VM* const vm, char const* const format, ...) {
+    // Pending script output first, so the report lands after everything the
+    // script managed to print.
+    print_flush();
+    fflush(stdout);
+
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    for (auto i = vm.frame_count - 1; i >= 0; --i) {
-        auto const frame = &vm.frames[i];
+    // Post-mortem first, while every traced function is still reachable.
+    tracer_dump(vm);
+
+    for (auto i = vm->frame_count - 1; i >= 0; --i) {
+        auto const frame = &vm->frames[i];
         auto const function = frame->closure->function;
         auto const instruction = (size_t)(frame->ip - function->chunk.code - 1);
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", chunk_line(&function->chunk, (int)instruction));
         if (function->name == nullptr) {
             fprintf(stderr, "script\n");
         } else {
@@ -62,109 +366,410 @@ static void runtime_error(char const* const format, ...) {
         }
     }
 
-    reset_stack();
+    // An error tears down the whole resume chain: the erroring fiber's
+    // context dies with it (after the stack trace above used it), and
+    // execution lands back in the main context so the next interpret() call
+    // starts from a clean slate.
+    if (vm->current_fiber != nullptr and vm->current_fiber->closure != nullptr) {
+        free(vm->frames);
+        free(vm->stack);
+        free(vm->open_upvalues);
+        auto fiber = vm->current_fiber;
+        while (fiber->closure != nullptr) {
+            fiber->state = FIBER_DONE;
+            fiber = fiber->caller;
+        }
+        restore_context(vm, fiber);
+        fiber->state = FIBER_RUNNING;
+        vm->current_fiber = fiber;
+    }
+
+    reset_stack(vm);
 }
 
-static void define_native(char const* const name, NativeFn const function) {
-    push(OBJ_VAL(copy_string(name, (int)strlen(name))));
-    push(OBJ_VAL(new_native(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    (void)pop();
-    (void)pop();
+// Resolves a global name to its stable slot index, assigning the next free
+// slot on first sight. Used by the compiler and by define_native().
+[[nodiscard]] int resolve_global_slot(VM* const vm, ObjString const* const name) {
+    Value slot_value;
+    if (table_get(&vm->global_names, OBJ_VAL((ObjString*)name), &slot_value)) {
+        return (int)AS_NUMBER(slot_value);
+    }
+
+    auto const slot = vm->global_values.count;
+    // Keep the name reachable while the slot array and name table grow.
+    push(vm, OBJ_VAL(name));
+    write_value_array(vm, &vm->global_values, UNDEFINED_VAL);
+    table_set(vm, &vm->global_names, OBJ_VAL((ObjString*)name), NUMBER_VAL((double)slot));
+    (void)pop(vm);
+    return slot;
 }
 
-void init_vm() {
-    reset_stack();
-    vm.objects = nullptr;
+// Reverse lookup for error messages and the disassembler; not a hot path.
+[[nodiscard]] ObjString const* global_name_for_slot(VM const* const vm, int const slot) {
+    for (auto i = 0; i < vm->global_names.capacity; ++i) {
+        auto const entry = &vm->global_names.entries[i];
+        if (not IS_UNDEFINED(entry->key) and (int)AS_NUMBER(entry->value) == slot) {
+            return AS_STRING(entry->key);
+        }
+    }
+    return nullptr;
+}
 
-    init_table(&vm.globals);
-    init_table(&vm.strings);
+static void define_native(VM* const vm, char const* const name, NativeFn const function) {
+    push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(new_native(vm, function)));
+    auto const slot = resolve_global_slot(vm, AS_STRING(vm->stack[0]));
+    vm->global_values.values[slot] = vm->stack[1];
+    (void)pop(vm);
+    (void)pop(vm);
+}
+
+void init_vm(VM* const vm) {
+    vm->frame_capacity = FRAMES_INITIAL_CAPACITY;
+    vm->frame_limit = FRAMES_DEFAULT_LIMIT;
+    vm->stack_capacity = STACK_INITIAL_CAPACITY;
+    vm->stack_limit = STACK_DEFAULT_LIMIT;
+    // Raw allocation (like the gray stack): the frames and the value stack
+    // are not part of the collected heap, and growing them must never
+    // trigger a collection.
+    vm->frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL_CAPACITY);
+    vm->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL_CAPACITY);
+    if (vm->frames == nullptr or vm->stack == nullptr) {
+        exit(1);
+    }
+    vm->open_upvalues = nullptr;
+    vm->open_upvalue_capacity = 0;
+    vm->current_fiber = nullptr;
+    vm->fiber_switched = false;
+    reset_stack(vm);
+    vm->objects = nullptr;
+
+    vm->bytes_allocated = 0;
+    vm->peak_allocated = 0;
+    vm->memory_limit = SIZE_MAX;
+    vm->oom_handler = nullptr;
+    memset(vm->object_counts, 0, sizeof(vm->object_counts));
+    vm->next_gc = 1024 * 1024;
+    vm->heap_grow_factor = GC_HEAP_GROW_FACTOR;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gray_stack = nullptr;
+    init_pools(vm);
 
-    define_native("clock", clock_native);
-    define_native("read_number", read_number_native);
+    init_profiler();
+    init_tracer();
+    init_table(&vm->global_names);
+    init_value_array(&vm->global_values);
+    init_table(&vm->strings);
+
+    define_native(vm, "clock", clock_native);
+    define_native(vm, "read_number", read_number_native);
+    define_native(vm, "string_builder", string_builder_native);
+    define_native(vm, "append", append_native);
+    define_native(vm, "build_string", build_string_native);
+    define_native(vm, "list", list_native);
+    define_native(vm, "push", push_native);
+    define_native(vm, "pop", pop_native);
+    define_native(vm, "len", len_native);
+    define_native(vm, "map", map_native);
+    define_native(vm, "map_get", map_get_native);
+    define_native(vm, "map_set", map_set_native);
+    define_native(vm, "map_delete", map_delete_native);
+    define_native(vm, "map_keys", map_keys_native);
+    define_native(vm, "fiber", fiber_native);
+    define_native(vm, "resume", resume_native);
+    define_native(vm, "yield", yield_native);
+    define_native(vm, "fiber_done", fiber_done_native);
+    define_native(vm, "profile", profile_native);
+    define_native(vm, "trace", trace_native);
+    define_native(vm, "trace_dump", trace_dump_native);
+    define_native(vm, "snapshot", snapshot_native);
+    define_native(vm, "memory_stats", memory_stats_native);
+    define_native(vm, "memory_limit", memory_limit_native);
+    define_native(vm, "stack_limits", stack_limits_native);
 }
 
-void free_vm() {
-    free_table(&vm.globals);
-    free_table(&vm.strings);
-    free_objects();
+void free_vm(VM* const vm) {
+    print_flush();
+    profiler_dump();
+    free_profiler();
+    free_tracer();
+    free_table(vm, &vm->global_names);
+    free_value_array(vm, &vm->global_values);
+    free_table(vm, &vm->strings);
+    free_objects(vm);
+    free(vm->frames);
+    free(vm->stack);
+    free(vm->open_upvalues);
 }
 
-void push(Value const value) {
-    *(vm.stack_top++) = value;
+void push(VM* const vm, Value const value) {
+    *(vm->stack_top++) = value;
 }
 
-[[nodiscard]] Value pop() {
-    return *(--vm.stack_top);
+[[nodiscard]] Value pop(VM* const vm) {
+    return *(--vm->stack_top);
 }
 
-[[nodiscard]] static Value peek(int const distance) {
-    return vm.stack_top[-1 - distance];
+[[nodiscard]] static Value peek(VM const* const vm, int const distance) {
+    return vm->stack_top[-1 - distance];
 }
 
-[[nodiscard]] static bool call(ObjClosure const* const closure, int const arg_count) {
+// Grows the value stack to hold at least `required` slots, rebasing every
+// pointer into it (the stack top, the frame windows and the open upvalue
+// locations) onto the new allocation. Returns false if that would exceed the
+// configured limit.
+[[nodiscard]] static bool grow_stack(VM* const vm, int const required) {
+    if (required > vm->stack_limit) {
+        return false;
+    }
+    auto new_capacity = vm->stack_capacity;
+    while (new_capacity < required) {
+        new_capacity *= 2;
+    }
+    if (new_capacity > vm->stack_limit) {
+        new_capacity = vm->stack_limit;
+    }
+
+    auto const old_stack = vm->stack;
+    vm->stack = (Value*)realloc(vm->stack, sizeof(Value) * (size_t)new_capacity);
+    if (vm->stack == nullptr) {
+        exit(1);
+    }
+    vm->stack_capacity = new_capacity;
+
+    if (vm->stack != old_stack) {
+        vm->stack_top = vm->stack + (vm->stack_top - old_stack);
+        for (auto i = 0; i < vm->frame_count; ++i) {
+            vm->frames[i].slots = vm->stack + (vm->frames[i].slots - old_stack);
+        }
+        for (auto i = 0; i < vm->open_upvalue_count; ++i) {
+            auto const upvalue = vm->open_upvalues[i];
+            upvalue->location = vm->stack + (upvalue->location - old_stack);
+        }
+    }
+    return true;
+}
+
+[[nodiscard]] static bool call(VM* const vm, ObjClosure const* const closure, int const arg_count) {
     if (arg_count != closure->function->arity) {
-        runtime_error("Expected %d arguments, but got %d.", closure->function->arity, arg_count);
+        runtime_error(vm, "Expected %d arguments, but got %d.", closure->function->arity, arg_count);
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX) {
-        runtime_error("Stack overflow.");
+    if (vm->frame_count == vm->frame_capacity) {
+        if (vm->frame_count >= vm->frame_limit) {
+            runtime_error(vm, "Stack overflow.");
+            return false;
+        }
+        auto new_capacity = vm->frame_capacity * 2;
+        if (new_capacity > vm->frame_limit) {
+            new_capacity = vm->frame_limit;
+        }
+        vm->frames = (CallFrame*)realloc(vm->frames, sizeof(CallFrame) * (size_t)new_capacity);
+        if (vm->frames == nullptr) {
+            exit(1);
+        }
+        vm->frame_capacity = new_capacity;
+    }
+
+    // A frame may use up to UINT8_COUNT slots (locals plus temporaries);
+    // reserving them up front keeps the pushes inside the frame check-free.
+    auto const slots_in_use = (int)(vm->stack_top - vm->stack);
+    if (slots_in_use + UINT8_COUNT > vm->stack_capacity and not grow_stack(vm, slots_in_use + UINT8_COUNT)) {
+        runtime_error(vm, "Stack overflow.");
         return false;
     }
 
-    auto const frame = &vm.frames[vm.frame_count++];
+    auto const frame = &vm->frames[vm->frame_count++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stack_top - arg_count - 1;
+    frame->slots = vm->stack_top - arg_count - 1;
+    if (profiler.enabled) {
+        profiler_record_call(closure->function, vm->frame_count - 1);
+    }
     return true;
 }
 
-[[nodiscard]] static bool call_value(Value const callee, int const arg_count) {
+[[nodiscard]] static bool call_value(VM* const vm, Value const callee, int const arg_count) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_CLOSURE:
-                return call(AS_CLOSURE(callee), arg_count);
+                return call(vm, AS_CLOSURE(callee), arg_count);
             case OBJ_NATIVE:
                 auto const native = AS_NATIVE(callee);
-                auto const result = native(arg_count, vm.stack_top - arg_count);
-                vm.stack_top -= arg_count + 1;
-                push(result);
+                auto const result = native(vm, arg_count, vm->stack_top - arg_count);
+                if (vm->fiber_switched) {
+                    // resume()/yield() replaced the whole context and already
+                    // arranged both stacks; there is no result to push here.
+                    vm->fiber_switched = false;
+                    return true;
+                }
+                vm->stack_top -= arg_count + 1;
+                push(vm, result);
                 return true;
             default:
                 break;  // Non-callable object type.
         }
     }
-    runtime_error("Can only call functions and classes.");
+    runtime_error(vm, "Can only call functions and classes.");
     return false;
 }
 
-[[nodiscard]] static ObjUpvalue* capture_upvalue(Value* const local) {
-    auto prev_upvalue = (ObjUpvalue*)nullptr;
-    auto upvalue = vm.open_upvalues;
-    while (upvalue != nullptr and upvalue->location > local) {
-        prev_upvalue = upvalue;
-        upvalue = upvalue->next;
+// Creates a suspended fiber that runs the given function when first resumed.
+// The function may take at most one parameter: the value passed along with
+// that first resume().
+static Value fiber_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count != 1 or not IS_CLOSURE(args[0]) or AS_CLOSURE(args[0])->function->arity > 1) {
+        return NIL_VAL;
     }
+    return OBJ_VAL(new_fiber(vm, AS_CLOSURE(args[0])));
+}
 
-    if (upvalue != nullptr and upvalue->location == local) {
-        return upvalue;
+// Switches execution to the given fiber. The resume() call evaluates to
+// whatever the fiber passes to yield() (or returns on completion); resuming
+// a fiber that is not resumable evaluates to nil without switching.
+static Value resume_native(VM* const vm, int const args_count, Value* const args) {
+    if (args_count < 1 or args_count > 2 or not IS_FIBER(args[0])) {
+        return NIL_VAL;
     }
+    auto const fiber = AS_FIBER(args[0]);
+    if (fiber->state != FIBER_NEW and fiber->state != FIBER_SUSPENDED) {
+        return NIL_VAL;
+    }
+    if (fiber->state == FIBER_NEW and fiber->closure->function->arity != (args_count == 2 ? 1 : 0)) {
+        return NIL_VAL;
+    }
+    auto const transfer = args_count == 2 ? args[1] : NIL_VAL;
 
-    auto const created_upvalue = new_upvalue(local);
-    created_upvalue->next = upvalue;
+    // The main script gets a fiber object of its own on first use, so that
+    // every suspended context lives in the same kind of place.
+    if (vm->current_fiber == nullptr) {
+        vm->current_fiber = new_fiber(vm, nullptr);
+    }
+    auto const resumer = vm->current_fiber;
 
-    (prev_upvalue == nullptr ? vm.open_upvalues : prev_upvalue->next) = created_upvalue;
+    // The call window of this native disappears from the resumer's stack;
+    // the value transferred back is pushed in its place when the resumer
+    // wakes again.
+    vm->stack_top = args - 1;
+    save_context(vm, resumer);
+    resumer->state = FIBER_WAITING;
+    fiber->caller = resumer;
 
+    if (fiber->state == FIBER_NEW) {
+        // Raw allocation, like the main context in init_vm().
+        vm->frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL_CAPACITY);
+        vm->stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL_CAPACITY);
+        if (vm->frames == nullptr or vm->stack == nullptr) {
+            exit(1);
+        }
+        vm->frame_capacity = FRAMES_INITIAL_CAPACITY;
+        vm->stack_capacity = STACK_INITIAL_CAPACITY;
+        vm->open_upvalues = nullptr;
+        vm->open_upvalue_capacity = 0;
+        reset_stack(vm);
+
+        push(vm, OBJ_VAL((ObjClosure*)fiber->closure));
+        auto const arity = fiber->closure->function->arity;
+        if (arity == 1) {
+            push(vm, transfer);
+        }
+        // Infallible: the arity was checked above and a fresh context cannot
+        // overflow.
+        (void)call(vm, fiber->closure, arity);
+    } else {
+        restore_context(vm, fiber);
+        push(vm, transfer);
+    }
+    fiber->state = FIBER_RUNNING;
+    vm->current_fiber = fiber;
+    vm->fiber_switched = true;
+    return NIL_VAL;  // Discarded: call_value() skips the result on a switch.
+}
+
+// Suspends the running fiber and hands the value back to its resumer. At the
+// top level there is nothing to suspend, so the value passes straight
+// through. Natives that would block can trigger the same switch to let
+// another fiber run in the meantime.
+static Value yield_native(VM* const vm, int const args_count, Value* const args) {
+    auto const transfer = args_count >= 1 ? args[0] : NIL_VAL;
+    auto const fiber = vm->current_fiber;
+    if (fiber == nullptr or fiber->closure == nullptr) {
+        return transfer;
+    }
+
+    vm->stack_top = args - 1;
+    save_context(vm, fiber);
+    fiber->state = FIBER_SUSPENDED;
+
+    auto const caller = fiber->caller;
+    restore_context(vm, caller);
+    caller->state = FIBER_RUNNING;
+    vm->current_fiber = caller;
+    push(vm, transfer);
+    vm->fiber_switched = true;
+    return NIL_VAL;
+}
+
+// Whether the fiber has run to completion and can no longer be resumed.
+static Value fiber_done_native(VM*, int const args_count, Value* const args) {
+    if (args_count != 1 or not IS_FIBER(args[0])) {
+        return NIL_VAL;
+    }
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+[[nodiscard]] static ObjUpvalue* capture_upvalue(VM* const vm, Value* const local) {
+    // Binary search for the first open upvalue at or above the local's
+    // address.
+    auto low = 0;
+    auto high = vm->open_upvalue_count;
+    while (low < high) {
+        auto const mid = (low + high) / 2;
+        if (vm->open_upvalues[mid]->location < local) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < vm->open_upvalue_count and vm->open_upvalues[low]->location == local) {
+        return vm->open_upvalues[low];
+    }
+
+    auto const created_upvalue = new_upvalue(vm, local);
+    if (vm->open_upvalue_count == vm->open_upvalue_capacity) {
+        vm->open_upvalue_capacity = vm->open_upvalue_capacity < 8 ? 8 : vm->open_upvalue_capacity * 2;
+        // Raw realloc (like the gray stack): the fresh upvalue is not rooted
+        // yet, so growing the array must never trigger a collection.
+        vm->open_upvalues =
+            (ObjUpvalue**)realloc(vm->open_upvalues, sizeof(ObjUpvalue*) * (size_t)vm->open_upvalue_capacity);
+        if (vm->open_upvalues == nullptr) {
+            exit(1);
+        }
+    }
+    // Captures usually happen at the top of the stack, making this append-
+    // only in practice.
+    memmove(
+        &vm->open_upvalues[low + 1],
+        &vm->open_upvalues[low],
+        sizeof(ObjUpvalue*) * (size_t)(vm->open_upvalue_count - low)
+    );
+    vm->open_upvalues[low] = created_upvalue;
+    ++vm->open_upvalue_count;
     return created_upvalue;
 }
 
-static void close_upvalues(Value const* const last) {
-    while (vm.open_upvalues != nullptr and vm.open_upvalues->location >= last) {
-        auto const upvalue = vm.open_upvalues;
+static void close_upvalues(VM* const vm, Value const* const last) {
+    // Everything at or above `last` sits at the tail of the sorted array.
+    while (vm->open_upvalue_count > 0) {
+        auto const upvalue = vm->open_upvalues[vm->open_upvalue_count - 1];
+        if (upvalue->location < last) {
+            break;
+        }
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
+        --vm->open_upvalue_count;
     }
 }
 
@@ -172,19 +777,19 @@ static void close_upvalues(Value const* const last) {
     return IS_NIL(value) or (IS_BOOL(value) and not AS_BOOL(value));
 }
 
-static void concatenate() {
+static void concatenate(VM* const vm) {
     // We first have to create a new string that contains the concatenated contents
     // of the source strings. But if the new string is equal to a string that already
-    // has been interned, we will free it immediately. In that case, however, we have
-    // to restore the implicit object list to prevent a double free when the VM exits.
-    // To be able to do this, we store the head of the objects list as it was before
-    // creating a new object.
-    auto const objects_list_head = vm.objects;
-
-    auto const b = AS_STRING(pop());
-    auto const a = AS_STRING(pop());
+    // has been interned, we will free it immediately. In that case it also has to be
+    // unlinked from the implicit object list to prevent a double free when the
+    // collector sweeps.
+
+    // The operands are only peeked (and popped at the end) so that they stay
+    // reachable if reserving the result string triggers a collection.
+    auto const b = AS_STRING(peek(vm, 0));
+    auto const a = AS_STRING(peek(vm, 1));
     auto const length = a->length + b->length;
-    auto const result = reserve_string(length, 0 /* Hash to be filled below. */);
+    auto const result = reserve_string(vm, length, 0 /* Hash to be filled below. */);
     memcpy(result->chars, a->chars, (size_t)a->length);
     memcpy(result->chars + a->length, b->chars, (size_t)b->length);
     auto const hash = hash_string(result->chars, length);
@@ -192,21 +797,73 @@ static void concatenate() {
     assert(result->chars[length] == '\0' and "reserve_string() shall create a null-terminated string");
 
     // Check if a string with this content already has been interned.
-    auto const interned = table_find_string(&vm.strings, result->chars, length, hash);
+    auto const interned = table_find_string(&vm->strings, result->chars, length, hash);
     if (interned != nullptr) {
-        FREE(ObjString, result);
-        // Restore object list.
-        vm.objects = objects_list_head;
-        push(OBJ_VAL(interned));
+        // Nothing has allocated since reserve_string() prepended the result,
+        // so it is still the list head. (A pre-allocation snapshot of the
+        // head would be stale here: reserving the string can itself trigger
+        // a collection that sweeps the previous head.)
+        assert(vm->objects == (Obj*)result and "the fresh string shall still head the object list");
+        vm->objects = result->obj.next;
+        // Freed directly rather than through free_object(), so the type
+        // count has to be balanced by hand or memory_stats() would drift.
+        --vm->object_counts[OBJ_STRING];
+        pool_free(vm, result, sizeof(ObjString) + (size_t)length + 1);
+        (void)pop(vm);
+        (void)pop(vm);
+        push(vm, OBJ_VAL(interned));
     } else {
-        // Intern the concatenated string.
-        table_set(&vm.strings, result, NIL_VAL);
-        push(OBJ_VAL(result));
+        // Intern the concatenated string. The result must be reachable while
+        // the intern table potentially grows.
+        push(vm, OBJ_VAL(result));
+        table_set(vm, &vm->strings, OBJ_VAL(result), NIL_VAL);
+        (void)pop(vm);
+        (void)pop(vm);
+        (void)pop(vm);
+        push(vm, OBJ_VAL(result));
+    }
+}
+
+// Counts the opcode about to be dispatched (when profiling is enabled) and
+// hands it through unchanged.
+[[nodiscard]] static uint8_t profile_opcode(uint8_t const opcode) {
+    if (profiler.enabled) {
+        ++profiler.opcode_counts[opcode];
     }
+    return opcode;
 }
 
-[[nodiscard]] static InterpretResult run() {
-    auto frame = &vm.frames[vm.frame_count - 1];
+// Computed goto (labels as values) is a GNU extension, so the direct-threaded
+// dispatch mode is only available on compilers that support it. Everyone else
+// falls back to the plain switch-based dispatch.
+#if defined(CLOX_THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define CLOX_COMPUTED_GOTO
+#endif
+
+#ifdef CLOX_COMPUTED_GOTO
+// Taking the address of a label is non-standard, which -Wpedantic rightfully
+// complains about. We opt in deliberately.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+[[nodiscard]] static InterpretResult run(VM* const vm) {
+    auto frame = &vm->frames[vm->frame_count - 1];
+    // The top of the stack is cached in a local (like the instruction pointer
+    // already is via `frame`) so the pushes and pops of the numeric inner
+    // loops stay in a register instead of going through vm->stack_top. The
+    // local is spilled (SYNC_STACK) before anything that reads the stack from
+    // the outside — calls, allocation (the collector walks the stack), and
+    // concatenate() — and reloaded afterwards where the callee pushed or
+    // popped itself. Error paths return without spilling, since
+    // runtime_error() resets the stack anyway.
+    auto stack_top = vm->stack_top;
+
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+#define SYNC_STACK() (vm->stack_top = stack_top)
+#define RELOAD_STACK() (stack_top = vm->stack_top)
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8 | frame->ip[-1])))
@@ -214,208 +871,581 @@ static void concatenate() {
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define BINARY_OP(value_type, op) \
     do { \
-        if (not IS_NUMBER(peek(0)) or not IS_NUMBER(peek(1))) { \
-            runtime_error("Operands must be numbers."); \
+        if (not IS_NUMBER(PEEK(0)) or not IS_NUMBER(PEEK(1))) { \
+            runtime_error(vm, "Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        auto const b = AS_NUMBER(pop()); \
-        auto const a = AS_NUMBER(pop()); \
-        push(value_type(a op b)); \
+        auto const b = AS_NUMBER(POP()); \
+        auto const a = AS_NUMBER(POP()); \
+        PUSH(value_type(a op b)); \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value const* slot = vm.stack; slot < vm.stack_top; ++slot) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION() \
+    do { \
+        printf("          "); \
+        for (Value const* slot = vm->stack; slot < stack_top; ++slot) { \
+            printf("[ "); \
+            print_value(*slot); \
+            print_flush(); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassemble_instruction( \
+            vm, \
+            &frame->closure->function->chunk, \
+            (int)(frame->ip - frame->closure->function->chunk.code) \
+        ); \
+    } while (false)
+#else
+#define TRACE_EXECUTION() \
+    do { \
+    } while (false)
 #endif
-        uint8_t instruction;
-        // clang-format off
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                auto const constant = READ_CONSTANT();
-                push(constant);
-                break;
+
+// Flight-recorder hook: a few stores into the trace ring per dispatched
+// instruction while recording is on (see tracer.h).
+#define TRACE_RECORD() \
+    do { \
+        if (tracer.enabled) { \
+            tracer_record( \
+                frame->closure->function, \
+                (int)(frame->ip - frame->closure->function->chunk.code), \
+                *frame->ip, \
+                vm->frame_count, \
+                (int)(stack_top - vm->stack) \
+            ); \
+        } \
+    } while (false)
+
+#ifdef CLOX_COMPUTED_GOTO
+#define VM_CASE(opcode) target_##opcode
+#define VM_DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        TRACE_RECORD(); \
+        goto* dispatch_table[profile_opcode(READ_BYTE())]; \
+    } while (false)
+
+    // The table must contain one entry per OpCode, in any order. Designated
+    // initializers keep it in sync with the enum.
+    static void* const dispatch_table[] = {
+        [OP_CONSTANT] = &&target_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&target_OP_CONSTANT_LONG,
+        [OP_NIL] = &&target_OP_NIL,
+        [OP_TRUE] = &&target_OP_TRUE,
+        [OP_FALSE] = &&target_OP_FALSE,
+        [OP_POP] = &&target_OP_POP,
+        [OP_GET_LOCAL] = &&target_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&target_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&target_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&target_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&target_OP_SET_GLOBAL,
+        [OP_EQUAL] = &&target_OP_EQUAL,
+        [OP_GREATER] = &&target_OP_GREATER,
+        [OP_LESS] = &&target_OP_LESS,
+        [OP_NEGATE] = &&target_OP_NEGATE,
+        [OP_PRINT] = &&target_OP_PRINT,
+        [OP_JUMP] = &&target_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&target_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_TRUE] = &&target_OP_JUMP_IF_TRUE,
+        [OP_LOOP] = &&target_OP_LOOP,
+        [OP_ADD] = &&target_OP_ADD,
+        [OP_SUBTRACT] = &&target_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&target_OP_MULTIPLY,
+        [OP_DIVIDE] = &&target_OP_DIVIDE,
+        [OP_NOT] = &&target_OP_NOT,
+        [OP_CALL] = &&target_OP_CALL,
+        [OP_TAIL_CALL] = &&target_OP_TAIL_CALL,
+        [OP_CLOSURE] = &&target_OP_CLOSURE,
+        [OP_GET_UPVALUE] = &&target_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&target_OP_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE] = &&target_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&target_OP_RETURN,
+        [OP_LIST] = &&target_OP_LIST,
+        [OP_INDEX_GET] = &&target_OP_INDEX_GET,
+        [OP_INDEX_SET] = &&target_OP_INDEX_SET,
+        [OP_ADD_LOCALS] = &&target_OP_ADD_LOCALS,
+        [OP_SET_LOCAL_POP] = &&target_OP_SET_LOCAL_POP,
+        [OP_LESS_CONSTANT] = &&target_OP_LESS_CONSTANT,
+        [OP_LESS_JUMP_IF_FALSE] = &&target_OP_LESS_JUMP_IF_FALSE,
+        [OP_ADD_CONSTANT] = &&target_OP_ADD_CONSTANT,
+        [OP_INCREMENT_LOCAL] = &&target_OP_INCREMENT_LOCAL,
+    };
+
+    VM_DISPATCH();
+#else
+#define VM_CASE(opcode) case opcode
+#define VM_DISPATCH() goto dispatch_loop
+
+dispatch_loop:
+    TRACE_EXECUTION();
+    TRACE_RECORD();
+    switch (profile_opcode(READ_BYTE()))
+#endif
+    // clang-format off
+    {
+        VM_CASE(OP_CONSTANT): {
+            auto const constant = READ_CONSTANT();
+            PUSH(constant);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_CONSTANT_LONG): {
+            uint8_t bytes[3];
+            bytes[0] = READ_BYTE();
+            bytes[1] = READ_BYTE();
+            bytes[2] = READ_BYTE();
+            auto const constant_index = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+            auto const constant = frame->closure->function->chunk.constants.values[constant_index];
+            PUSH(constant);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_NEGATE): {
+            if (not IS_NUMBER(PEEK(0))) {
+                runtime_error(vm, "Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CONSTANT_LONG: {
-                uint8_t bytes[3];
-                bytes[0] = READ_BYTE();
-                bytes[1] = READ_BYTE();
-                bytes[2] = READ_BYTE();
-                auto const constant_index = (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
-                auto const constant = frame->closure->function->chunk.constants.values[constant_index];
-                push(constant);
-                break;
+            PUSH(NUMBER_VAL(-AS_NUMBER(POP())));
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_NIL):   PUSH(NIL_VAL);         VM_DISPATCH();
+        VM_CASE(OP_TRUE):  PUSH(BOOL_VAL(true));  VM_DISPATCH();
+        VM_CASE(OP_FALSE): PUSH(BOOL_VAL(false)); VM_DISPATCH();
+        VM_CASE(OP_POP):   (void)POP();           VM_DISPATCH();
+        VM_CASE(OP_GET_LOCAL): {
+            auto const slot = READ_BYTE();
+            PUSH(frame->slots[slot]);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_SET_LOCAL): {
+            auto const slot = READ_BYTE();
+            frame->slots[slot] = PEEK(0);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_GET_GLOBAL): {
+            auto const slot = READ_BYTE();
+            auto const value = vm->global_values.values[slot];
+            if (IS_UNDEFINED(value)) {
+                runtime_error(vm, "Undefined variable '%s'.", global_name_for_slot(vm, slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_NEGATE:
-                if (not IS_NUMBER(peek(0))) {
-                    runtime_error("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_NIL:      push(NIL_VAL);                    break;
-            case OP_TRUE:     push(BOOL_VAL(true));             break;
-            case OP_FALSE:    push(BOOL_VAL(false));            break;
-            case OP_POP:      (void)pop();                      break;
-            case OP_GET_LOCAL: {
-                auto const slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+            PUSH(value);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_DEFINE_GLOBAL): {
+            auto const slot = READ_BYTE();
+            // The slot array was already grown when the slot was resolved —
+            // at compile time, or in loxb_read()'s renumbering for cached
+            // code — so this cannot allocate.
+            vm->global_values.values[slot] = POP();
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); VM_DISPATCH();
+        VM_CASE(OP_LESS):    BINARY_OP(BOOL_VAL, <); VM_DISPATCH();
+        VM_CASE(OP_ADD): {
+            if (IS_STRING(PEEK(0)) and IS_STRING(PEEK(1))) {
+                SYNC_STACK();
+                concatenate(vm);
+                RELOAD_STACK();
+            } else if (IS_NUMBER(PEEK(0)) and IS_NUMBER(PEEK(1))) {
+                auto const b = AS_NUMBER(POP());
+                auto const a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            } else {
+                runtime_error(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_LOCAL: {
-                auto const slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -);           VM_DISPATCH();
+        VM_CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *);           VM_DISPATCH();
+        VM_CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /);           VM_DISPATCH();
+        VM_CASE(OP_NOT):      PUSH(BOOL_VAL(is_falsey(POP())));   VM_DISPATCH();
+        VM_CASE(OP_SET_GLOBAL): {
+            auto const slot = READ_BYTE();
+            if (IS_UNDEFINED(vm->global_values.values[slot])) {
+                runtime_error(vm, "Undefined variable '%s'.", global_name_for_slot(vm, slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_GLOBAL: {
-                auto const name = READ_STRING();
-                Value value;
-                if (not table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
+            vm->global_values.values[slot] = PEEK(0);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_GET_UPVALUE): {
+            auto const slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_SET_UPVALUE): {
+            auto const slot = READ_BYTE();
+            *frame->closure->upvalues[slot]->location = PEEK(0);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_EQUAL): {
+            auto const b = POP();
+            auto const a = POP();
+            PUSH(BOOL_VAL(values_equal(a, b)));
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_PRINT): {
+            print_value(POP());
+            print_text("\n");
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_JUMP): {
+            auto const offset = READ_SHORT();
+            frame->ip += offset;
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_JUMP_IF_FALSE): {
+            auto const offset = READ_SHORT();
+            if (is_falsey(PEEK(0))) {
+                frame->ip += offset;
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_JUMP_IF_TRUE): {
+            auto const offset = READ_SHORT();
+            if (not is_falsey(PEEK(0))) {
+                frame->ip += offset;
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_LOOP): {
+            auto const offset = READ_SHORT();
+            frame->ip -= offset;
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_CALL): {
+            auto const arg_count = READ_BYTE();
+            // call_value() derives the callee frame (or the native argument
+            // window) from vm->stack_top, and natives push their result.
+            SYNC_STACK();
+            if (not call_value(vm, PEEK(arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            RELOAD_STACK();
+            frame = &vm->frames[vm->frame_count - 1];
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_TAIL_CALL): {
+            auto const arg_count = READ_BYTE();
+            auto const callee = PEEK(arg_count);
+            if (not IS_OBJ(callee) or OBJ_TYPE(callee) != OBJ_CLOSURE) {
+                // Natives (and non-callable values, which error) take the
+                // regular call path; the OP_RETURN following this instruction
+                // then returns the native's result.
+                SYNC_STACK();
+                if (not call_value(vm, callee, arg_count)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
-                break;
+                RELOAD_STACK();
+                // A resume()/yield() in tail position switches fibers; the
+                // reload is a no-op for every other native.
+                frame = &vm->frames[vm->frame_count - 1];
+                VM_DISPATCH();
             }
-            case OP_DEFINE_GLOBAL: {
-                auto const name = READ_STRING();
-                table_set(&vm.globals, name, peek(0));
-                (void)pop();
-                break;
+
+            auto const closure = AS_CLOSURE(callee);
+            if (arg_count != closure->function->arity) {
+                runtime_error(vm, "Expected %d arguments, but got %d.", closure->function->arity, arg_count);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            // The current frame is finished: close over its locals and let
+            // the profiler see the return before the frame is reused.
+            close_upvalues(vm, frame->slots);
+            if (profiler.enabled) {
+                profiler_record_return(frame->closure->function, vm->frame_count - 1);
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >);           break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <);           break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) and IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) and IS_NUMBER(peek(1))) {
-                    auto const b = AS_NUMBER(pop());
-                    auto const a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+
+            // Slide the callee and its arguments down into the reused
+            // frame's window; everything above belonged to the finished
+            // invocation.
+            memmove(frame->slots, stack_top - arg_count - 1, sizeof(Value) * ((size_t)arg_count + 1));
+            stack_top = frame->slots + arg_count + 1;
+            frame->closure = closure;
+            frame->ip = closure->function->chunk.code;
+            if (profiler.enabled) {
+                profiler_record_call(closure->function, vm->frame_count - 1);
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_CLOSURE): {
+            auto const function = AS_FUNCTION(READ_CONSTANT());
+            SYNC_STACK();
+            auto const closure = new_closure(vm, function);
+            PUSH(OBJ_VAL(closure));
+            // Spill again so the closure stays reachable while the upvalues
+            // below are allocated.
+            SYNC_STACK();
+            for (auto i = 0; i < closure->upvalue_count; ++i) {
+                auto const is_local = READ_BYTE();
+                auto const index = READ_BYTE();
+                if (is_local == 1) {
+                    closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
                 } else {
-                    runtime_error("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                break;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -);         break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *);         break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /);         break;
-            case OP_NOT:      push(BOOL_VAL(is_falsey(pop()))); break;
-            case OP_SET_GLOBAL: {
-                auto const name = READ_STRING();
-                if (table_set(&vm.globals, name, peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_CLOSE_UPVALUE): {
+            close_upvalues(vm, stack_top - 1);
+            (void)POP();
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_RETURN): {
+            auto const result = POP();
+            close_upvalues(vm, frame->slots);
+            if (profiler.enabled) {
+                profiler_record_return(frame->closure->function, vm->frame_count - 1);
+            }
+            --vm->frame_count;
+            if (vm->frame_count == 0) {
+                auto const fiber = vm->current_fiber;
+                if (fiber != nullptr and fiber->closure != nullptr) {
+                    // The fiber ran to completion: its context is dead, so
+                    // free it right away (thousands of finished fibers must
+                    // not pin thousands of stacks) and wake the resumer with
+                    // the return value as the result of its resume().
+                    fiber->state = FIBER_DONE;
+                    free(vm->frames);
+                    free(vm->stack);
+                    free(vm->open_upvalues);
+                    auto const caller = fiber->caller;
+                    restore_context(vm, caller);
+                    caller->state = FIBER_RUNNING;
+                    vm->current_fiber = caller;
+                    RELOAD_STACK();
+                    PUSH(result);
+                    frame = &vm->frames[vm->frame_count - 1];
+                    VM_DISPATCH();
                 }
-                break;
+                (void)POP(); // Pop the main script function.
+                SYNC_STACK();
+                return INTERPRET_OK;
+            }
+
+            stack_top = frame->slots;
+            PUSH(result);
+            frame = &vm->frames[vm->frame_count - 1];
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_LIST): {
+            auto const count = READ_BYTE();
+            // The elements sit on the stack and the list is pushed before its
+            // buffer grows, so everything stays reachable throughout.
+            SYNC_STACK();
+            auto const list = new_list(vm);
+            PUSH(OBJ_VAL(list));
+            SYNC_STACK();
+            for (auto i = 0; i < count; ++i) {
+                write_value_array(vm, &list->items, PEEK(count - i));
             }
-            case OP_GET_UPVALUE: {
-                auto const slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            stack_top -= count + 1;
+            PUSH(OBJ_VAL(list));
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_INDEX_GET): {
+            if (IS_MAP(PEEK(1))) {
+                auto const key = POP();
+                auto const map = AS_MAP(POP());
+                Value value;
+                // An absent key reads as nil.
+                PUSH(table_get(&map->table, key, &value) ? value : NIL_VAL);
+                VM_DISPATCH();
             }
-            case OP_SET_UPVALUE: {
-                auto const slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            if (not IS_LIST(PEEK(1))) {
+                runtime_error(vm, "Can only index into lists and maps.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_EQUAL: {
-                auto const b = pop();
-                auto const a = pop();
-                push(BOOL_VAL(values_equal(a, b)));
-                break;
+            if (not IS_NUMBER(PEEK(0))) {
+                runtime_error(vm, "List index must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_PRINT:
-                print_value(pop());
-                printf("\n");
-                break;
-            case OP_JUMP: {
-                auto const offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            auto const index = (int)AS_NUMBER(POP());
+            auto const list = AS_LIST(POP());
+            if (index < 0 or index >= list->items.count) {
+                runtime_error(vm, "List index out of bounds.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP_IF_FALSE: {
-                auto const offset = READ_SHORT();
-                if (is_falsey(peek(0))) {
-                    frame->ip += offset;
+            PUSH(list->items.values[index]);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_INDEX_SET): {
+            if (IS_MAP(PEEK(2))) {
+                auto const map = AS_MAP(PEEK(2));
+                // Growing the table can allocate; the operands stay rooted on
+                // the stack until it is done.
+                SYNC_STACK();
+                if (table_set(vm, &map->table, PEEK(1), PEEK(0))) {
+                    ++map->count;
                 }
-                break;
+                auto const value = POP();
+                stack_top -= 2;
+                // An assignment is an expression; it evaluates to the value.
+                PUSH(value);
+                VM_DISPATCH();
             }
-            case OP_LOOP: {
-                auto const offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            if (not IS_LIST(PEEK(2))) {
+                runtime_error(vm, "Can only index into lists and maps.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CALL: {
-                auto const arg_count = READ_BYTE();
-                if (not call_value(peek(arg_count), arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            if (not IS_NUMBER(PEEK(1))) {
+                runtime_error(vm, "List index must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSURE: {
-                auto const function = AS_FUNCTION(READ_CONSTANT());
-                auto const closure = new_closure(function);
-                push(OBJ_VAL(closure));
-                for (auto i = 0; i < closure->upvalue_count; ++i) {
-                    auto const is_local = READ_BYTE();
-                    auto const index = READ_BYTE();
-                    if (is_local == 1) {
-                        closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+            auto const value = POP();
+            auto const index = (int)AS_NUMBER(POP());
+            auto const list = AS_LIST(POP());
+            if (index < 0 or index >= list->items.count) {
+                runtime_error(vm, "List index out of bounds.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSE_UPVALUE:
-                close_upvalues(vm.stack_top - 1);
-                (void)pop();
-                break;
-            case OP_RETURN: {
-                auto const result = pop();
-                close_upvalues(frame->slots);
-                --vm.frame_count;
-                if (vm.frame_count == 0) {
-                    (void)pop(); // Pop the main script function.
-                    return INTERPRET_OK;
-                }
-
-                vm.stack_top = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            list->items.values[index] = value;
+            // An assignment is an expression; it evaluates to the value.
+            PUSH(value);
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_ADD_LOCALS): {
+            auto const slot_a = READ_BYTE();
+            auto const slot_b = READ_BYTE();
+            auto const a = frame->slots[slot_a];
+            auto const b = frame->slots[slot_b];
+            if (IS_NUMBER(a) and IS_NUMBER(b)) {
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else if (IS_STRING(a) and IS_STRING(b)) {
+                PUSH(a);
+                PUSH(b);
+                SYNC_STACK();
+                concatenate(vm);
+                RELOAD_STACK();
+            } else {
+                runtime_error(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_SET_LOCAL_POP): {
+            auto const slot = READ_BYTE();
+            frame->slots[slot] = POP();
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_LESS_CONSTANT): {
+            auto const constant = READ_CONSTANT();
+            if (not IS_NUMBER(PEEK(0)) or not IS_NUMBER(constant)) {
+                runtime_error(vm, "Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            auto const a = AS_NUMBER(POP());
+            PUSH(BOOL_VAL(a < AS_NUMBER(constant)));
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_ADD_CONSTANT): {
+            auto const constant = READ_CONSTANT();
+            if (IS_NUMBER(PEEK(0)) and IS_NUMBER(constant)) {
+                auto const a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + AS_NUMBER(constant)));
+            } else if (IS_STRING(PEEK(0)) and IS_STRING(constant)) {
+                PUSH(constant);
+                SYNC_STACK();
+                concatenate(vm);
+                RELOAD_STACK();
+            } else {
+                runtime_error(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_INCREMENT_LOCAL): {
+            auto const slot = READ_BYTE();
+            auto const constant = READ_CONSTANT();
+            auto const value = frame->slots[slot];
+            if (IS_NUMBER(value) and IS_NUMBER(constant)) {
+                frame->slots[slot] = NUMBER_VAL(AS_NUMBER(value) + AS_NUMBER(constant));
+            } else if (IS_STRING(value) and IS_STRING(constant)) {
+                PUSH(value);
+                PUSH(constant);
+                SYNC_STACK();
+                concatenate(vm);
+                RELOAD_STACK();
+                frame->slots[slot] = POP();
+            } else {
+                runtime_error(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            VM_DISPATCH();
+        }
+        VM_CASE(OP_LESS_JUMP_IF_FALSE): {
+            auto const offset = READ_SHORT();
+            if (not IS_NUMBER(PEEK(0)) or not IS_NUMBER(PEEK(1))) {
+                runtime_error(vm, "Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            auto const b = AS_NUMBER(POP());
+            auto const a = AS_NUMBER(POP());
+            auto const result = a < b;
+            PUSH(BOOL_VAL(result));
+            if (not result) {
+                frame->ip += offset;
+            }
+            VM_DISPATCH();
         }
-        // clang-format on
     }
+    // clang-format on
+
+#ifndef CLOX_COMPUTED_GOTO
+    // An unknown opcode falls out of the switch; keep going like before.
+    VM_DISPATCH();
+#endif
 
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SYNC_STACK
+#undef RELOAD_STACK
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef TRACE_EXECUTION
+#undef TRACE_RECORD
+#undef VM_CASE
+#undef VM_DISPATCH
+}
+
+#ifdef CLOX_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+[[nodiscard]] InterpretResult interpret_compiled(VM* const vm, ObjFunction const* const function) {
+    // Exceeding the memory limit unwinds to here from deep inside the
+    // allocator (see out_of_memory() in memory.c); runtime_error() then
+    // reports it like any other error and resets the stack.
+    jmp_buf oom_handler;
+    if (setjmp(oom_handler) != 0) {
+        vm->oom_handler = nullptr;
+        runtime_error(vm, "Out of memory: limit of %zu bytes exceeded.", vm->memory_limit);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm->oom_handler = &oom_handler;
+
+    push(vm, OBJ_VAL(function));
+    auto const closure = new_closure(vm, function);
+    (void)pop(vm);
+    push(vm, OBJ_VAL(closure));
+    (void)call(vm, closure, 0);
+    auto const result = run(vm);
+    vm->oom_handler = nullptr;
+    return result;
 }
 
-[[nodiscard]] InterpretResult interpret(char const* const source) {
-    auto const function = compile(source);
+[[nodiscard]] InterpretResult interpret(VM* const vm, char const* const source) {
+    auto const function = compile(vm, source);
     if (function == nullptr) {
         return INTERPRET_COMPILE_ERROR;
     }
 
-    push(OBJ_VAL(function));
-    auto const closure = new_closure(function);
-    (void)pop();
-    push(OBJ_VAL(closure));
-    (void)call(closure, 0);
-    return run();
+    return interpret_compiled(vm, function);
 }
@@ -1,29 +1,76 @@
 #pragma once
 
+#include <setjmp.h>
+
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The call-frame array and the value stack start small (so pooled idle VMs
+// stay cheap) and grow geometrically up to the runtime-configurable limits
+// below, which default to far deeper recursion than the old fixed arrays
+// allowed. Embedders can adjust the limits by assigning frame_limit and
+// stack_limit after init_vm(); scripts can use the stack_limits() native.
+#define FRAMES_INITIAL_CAPACITY 8
+#define FRAMES_DEFAULT_LIMIT 1024
+#define STACK_INITIAL_CAPACITY (FRAMES_INITIAL_CAPACITY * UINT8_COUNT)
+#define STACK_DEFAULT_LIMIT (FRAMES_DEFAULT_LIMIT * UINT8_COUNT)
 
-typedef struct {
+typedef struct CallFrame {
     ObjClosure const* closure;
     uint8_t const* ip;
     Value* slots;
 } CallFrame;
 
-typedef struct {
-    CallFrame frames[FRAMES_MAX];
+typedef struct VM {
+    CallFrame* frames;
     int frame_count;
+    int frame_capacity;
+    int frame_limit;
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stack_top;
-    Table globals;
+    int stack_capacity;  // in slots
+    int stack_limit;  // in slots
+    // Globals are stored in a slot-indexed array; the table only resolves
+    // names to slots (at compile time and for error messages).
+    Table global_names;
+    ValueArray global_values;
     Table strings;
-    ObjUpvalue* open_upvalues;
+    // Upvalues still pointing into the stack, in a contiguous array sorted by
+    // stack address: captures binary-search it and closes pop from its tail,
+    // replacing the pointer-chasing of an intrusive linked list.
+    ObjUpvalue** open_upvalues;
+    int open_upvalue_count;
+    int open_upvalue_capacity;
+    // The frames/stack/open-upvalue fields above always describe the running
+    // context; each suspended fiber keeps its own copies (see ObjFiber).
+    // current_fiber is nullptr until the first resume() wraps the main script
+    // in a fiber of its own. fiber_switched tells call_value() that a native
+    // has already swapped the context and arranged both stacks.
+    ObjFiber* current_fiber;
+    bool fiber_switched;
+
+    size_t bytes_allocated;
+    size_t peak_allocated;
+    // Hard ceiling on bytes_allocated (SIZE_MAX means unlimited; scripts can
+    // adjust it via the memory_limit() native). Breaching it forces a
+    // collection; if that does not free enough, the script is aborted with a
+    // runtime error by unwinding to oom_handler (see memory.c).
+    size_t memory_limit;
+    jmp_buf* oom_handler;
+    // Live objects per ObjType, maintained by allocate_object() and
+    // free_object().
+    int object_counts[OBJ_TYPE_COUNT];
+    size_t next_gc;
+    double heap_grow_factor;
     Obj* objects;
+    ObjectPool pools[POOL_SIZE_CLASS_COUNT];
+    int gray_count;
+    int gray_capacity;
+    Obj** gray_stack;
 } VM;
 
 typedef enum {
@@ -32,10 +79,11 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
-
-void init_vm();
-void free_vm();
-[[nodiscard]] InterpretResult interpret(char const* source);
-void push(Value value);
-[[nodiscard]] Value pop();
+void init_vm(VM* vm);
+void free_vm(VM* vm);
+[[nodiscard]] int resolve_global_slot(VM* vm, ObjString const* name);
+[[nodiscard]] ObjString const* global_name_for_slot(VM const* vm, int slot);
+[[nodiscard]] InterpretResult interpret(VM* vm, char const* source);
+[[nodiscard]] InterpretResult interpret_compiled(VM* vm, ObjFunction const* function);
+void push(VM* vm, Value value);
+[[nodiscard]] Value pop(VM* vm);